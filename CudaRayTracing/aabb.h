@@ -11,7 +11,20 @@ public:
 	XPU point3 min() const { return minimum; }
 	XPU point3 max() const { return maximum; }
 
+	XPU point3 centroid() const { return 0.5f * (minimum + maximum); }
+
+	XPU float surface_area() const {
+		vec3 d = maximum - minimum;
+		return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
 	XPU bool hit(const ray& r, float t_min, float t_max) const;
+	XPU bool hit(const ray& r, const vec3& inv_dir, const int dir_is_neg[3], float t_min, float t_max) const;
+
+	// Box containing nothing, used as the starting point when growing bounds
+	XPU static aabb empty() {
+		return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+	}
 
 public:
 	point3 minimum;
@@ -33,7 +46,24 @@ XPU inline bool aabb::hit(const ray& r, float t_min, float t_max) const {
 	return true;
 }
 
-XPU inline aabb surrounding_box(aabb& box0, aabb& box1) {
+XPU inline bool aabb::hit(const ray& r, const vec3& inv_dir, const int dir_is_neg[3], float t_min, float t_max) const {
+	// slab test with the reciprocal direction and its signs precomputed once per ray by the caller
+	const point3& o = r.origin();
+	const point3* bounds[2] = { &minimum, &maximum };
+
+	float tx0 = ((*bounds[dir_is_neg[0]])[0] - o[0]) * inv_dir[0];
+	float tx1 = ((*bounds[1 - dir_is_neg[0]])[0] - o[0]) * inv_dir[0];
+	float ty0 = ((*bounds[dir_is_neg[1]])[1] - o[1]) * inv_dir[1];
+	float ty1 = ((*bounds[1 - dir_is_neg[1]])[1] - o[1]) * inv_dir[1];
+	float tz0 = ((*bounds[dir_is_neg[2]])[2] - o[2]) * inv_dir[2];
+	float tz1 = ((*bounds[1 - dir_is_neg[2]])[2] - o[2]) * inv_dir[2];
+
+	t_min = fmax(t_min, fmax(tx0, fmax(ty0, tz0)));
+	t_max = fmin(t_max, fmin(tx1, fmin(ty1, tz1)));
+	return t_min <= t_max;
+}
+
+XPU inline aabb surrounding_box(const aabb& box0, const aabb& box1) {
 	point3 mini(fmin(box0.min().x(), box1.min().x()),
 			fmin(box0.min().y(), box1.min().y()),
 			fmin(box0.min().z(), box1.min().z()));
@@ -44,3 +74,8 @@ XPU inline aabb surrounding_box(aabb& box0, aabb& box1) {
 
 	return aabb(mini, maxi);
 }
+
+XPU inline aabb surrounding_box(const aabb& box, const point3& p) {
+	return aabb(point3(fmin(box.min().x(), p.x()), fmin(box.min().y(), p.y()), fmin(box.min().z(), p.z())),
+			point3(fmax(box.max().x(), p.x()), fmax(box.max().y(), p.y()), fmax(box.max().z(), p.z())));
+}
@@ -1,27 +1,48 @@
 #pragma once
 #include "hittable.h"
 
-class xy_rect : public hittable {
+// Solid angle density of v when points are picked uniformly on a rect of the given area
+template<class R>
+GPU inline float rect_pdf_value(const R* rect, float area, const point3& o, const vec3& v) {
+	hit_record rec;
+	if (!rect->hit(ray(o, v), 0.001f, infinity, rec))
+		return 0;
+
+	float distance_squared = rec.t * rec.t * v.length_squared();
+	float cosine = fabs(dot(v, rec.normal) / v.length());
+	return distance_squared / (cosine * area);
+}
+
+class xy_rect {
 public:
-	GPU xy_rect() {}
+	XPU xy_rect() {}
 
-	GPU xy_rect(float _x0, float _x1, float _y0, float _y1, float _k, material* mat) :
-			x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {}
+	XPU xy_rect(float _x0, float _x1, float _y0, float _y1, float _k, int mat) :
+			x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), material_id(mat) {}
 
-	GPU virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
 
-	GPU virtual bool bounding_box(float time0, float time1, aabb& output_box) const override {
+	XPU bool bounding_box(float time0, float time1, aabb& output_box) const {
 		// rect should have some dimension in z-axis as well
 		output_box = aabb(point3(x0, y0, k - 0.0001f), point3(x1, y1, k + 0.0001f));
 		return true;
 	}
 
+	GPU float pdf_value(const point3& o, const vec3& v) const {
+		return rect_pdf_value(this, (x1 - x0) * (y1 - y0), o, v);
+	}
+
+	GPU vec3 random(const vec3& o, rng* local_rand) const {
+		point3 random_point(cu_random_float(x0, x1, local_rand), cu_random_float(y0, y1, local_rand), k);
+		return random_point - o;
+	}
+
 public:
 	float x0, x1, y0, y1, k;
-	material* mp;
+	int material_id;
 };
 
-GPU inline bool xy_rect::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+XPU inline bool xy_rect::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 	float t = (k - r.origin().z()) / r.direction().z();
 	if (t < t_min || t > t_max)
 		return false;
@@ -36,49 +57,41 @@ GPU inline bool xy_rect::hit(const ray& r, float t_min, float t_max, hit_record&
 	rec.t = t;
 	vec3 outward_normal = vec3(0, 0, 1);
 	rec.set_face_normal(r, outward_normal);
-	rec.material_ptr = mp;
+	rec.material_id = material_id;
 	rec.p = r.at(t);
 	return true;
 }
 
-class xz_rect : public hittable {
+class xz_rect {
 public:
-	GPU xz_rect() {}
+	XPU xz_rect() {}
 
-	GPU xz_rect(float _x0, float _x1, float _z0, float _z1, float _k, material* mat) :
-			x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
+	XPU xz_rect(float _x0, float _x1, float _z0, float _z1, float _k, int mat) :
+			x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), material_id(mat) {}
 
-	GPU virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
 
-	GPU virtual bool bounding_box(float time0, float time1, aabb& output_box) const override {
+	XPU bool bounding_box(float time0, float time1, aabb& output_box) const {
 		// rect should have some dimension in y-axis as well
 		output_box = aabb(point3(x0, k - 0.0001f, z0), point3(x1, k + 0.0001f, z1));
 		return true;
 	}
 
-	GPU virtual float pdf_value(const point3& o, const vec3& v) const override {
-		hit_record rec;
-		if (!this->hit(ray(o, v), 0.001f, infinity, rec))
-			return 0;
-
-		float area = (x1 - x0) * (z1 - z0);
-		float distance_squared = rec.t * rec.t * v.length_squared();
-		float cosine = fabs(dot(v, rec.normal) / v.length());
-
-		return distance_squared / (cosine * area);
+	GPU float pdf_value(const point3& o, const vec3& v) const {
+		return rect_pdf_value(this, (x1 - x0) * (z1 - z0), o, v);
 	}
 
-	GPU virtual vec3 random(const vec3& o) const override {
-		point3 random_point(random_float(x0, x1), k, random_float(z0, z1));
+	GPU vec3 random(const vec3& o, rng* local_rand) const {
+		point3 random_point(cu_random_float(x0, x1, local_rand), k, cu_random_float(z0, z1, local_rand));
 		return random_point - o;
 	}
 
 public:
 	float x0, x1, z0, z1, k;
-	material* mp;
+	int material_id;
 };
 
-GPU inline bool xz_rect::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+XPU inline bool xz_rect::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 	float t = (k - r.origin().y()) / r.direction().y();
 	if (t < t_min || t > t_max)
 		return false;
@@ -93,32 +106,41 @@ GPU inline bool xz_rect::hit(const ray& r, float t_min, float t_max, hit_record&
 	rec.t = t;
 	vec3 outward_normal = vec3(0, 1, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.material_ptr = mp;
+	rec.material_id = material_id;
 	rec.p = r.at(t);
 	return true;
 }
 
-class yz_rect : public hittable {
+class yz_rect {
 public:
-	GPU yz_rect() {}
+	XPU yz_rect() {}
 
-	GPU yz_rect(float _y0, float _y1, float _z0, float _z1, float _k, material* mat) :
-			y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {}
+	XPU yz_rect(float _y0, float _y1, float _z0, float _z1, float _k, int mat) :
+			y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), material_id(mat) {}
 
-	GPU virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
 
-	GPU virtual bool bounding_box(float time0, float time1, aabb& output_box) const override {
+	XPU bool bounding_box(float time0, float time1, aabb& output_box) const {
 		// rect should have some dimension in x-axis as well
 		output_box = aabb(point3(k - 0.0001f, y0, z0), point3(k + 0.0001f, y1, z1));
 		return true;
 	}
 
+	GPU float pdf_value(const point3& o, const vec3& v) const {
+		return rect_pdf_value(this, (y1 - y0) * (z1 - z0), o, v);
+	}
+
+	GPU vec3 random(const vec3& o, rng* local_rand) const {
+		point3 random_point(k, cu_random_float(y0, y1, local_rand), cu_random_float(z0, z1, local_rand));
+		return random_point - o;
+	}
+
 public:
 	float y0, y1, z0, z1, k;
-	material* mp;
+	int material_id;
 };
 
-GPU inline bool yz_rect::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+XPU inline bool yz_rect::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 	float t = (k - r.origin().x()) / r.direction().x();
 	if (t < t_min || t > t_max)
 		return false;
@@ -133,7 +155,7 @@ GPU inline bool yz_rect::hit(const ray& r, float t_min, float t_max, hit_record&
 	rec.t = t;
 	vec3 outward_normal = vec3(1, 0, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.material_ptr = mp;
+	rec.material_id = material_id;
 	rec.p = r.at(t);
 	return true;
 }
\ No newline at end of file
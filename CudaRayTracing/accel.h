@@ -0,0 +1,70 @@
+#pragma once
+
+#include "bvh.h"
+#include "scene.h"
+
+#include <vector>
+
+/**
+ * \brief One level of the acceleration structure: the primitives it is built over and its BVH in the
+ * scene. Instanced scenes have a bottom level per unique object and a top level over the instances.
+ */
+struct accel_level {
+	explicit accel_level(float rebuild_threshold = 1.3f) :
+			tree(rebuild_threshold) {}
+
+	std::vector<int> prims;
+	int bvh = -1;				///> index in the scene's BVHs once built
+	dynamic_bvh tree;
+};
+
+/**
+ * \brief Brings the BVH over level.prims up to date with the current primitive bounds, calling build(boxes)
+ * for a full rebuild. The first call builds it and adds it to the scene; later calls, e.g. per frame after
+ * primitives moved, refit the nodes in place and only rebuild once the tree has degraded.
+ * Returns true after a build.
+ */
+template<class F>
+bool update_accel(scene_builder& world, accel_level& level, F build) {
+	const scene view = world.view();
+	std::vector<aabb> boxes(level.prims.size());
+	for (size_t i = 0; i < boxes.size(); i++) {
+		if (!view.bounding_box(level.prims[i], 0, 1, boxes[i]))
+			boxes[i] = aabb::empty();
+	}
+
+	bool rebuilt = level.tree.update(boxes, build);
+	if (level.bvh >= 0)
+		world.set_bvh(level.bvh, level.tree.tree(), level.prims);
+	else
+		level.bvh = world.add_bvh(level.tree.tree(), level.prims);
+	return rebuilt;
+}
+
+/**
+ * \brief All levels of a scene's acceleration structure.
+ * An instance takes its bounds from the root of its bottom level, so whenever a bottom level changes, even
+ * by a refit, the top level has to be updated after it; update() does both in that order.
+ */
+struct scene_accel {
+	explicit scene_accel(float rebuild_threshold = 1.3f) :
+			top(rebuild_threshold), threshold(rebuild_threshold) {}
+
+	// Adds an empty bottom level, valid until the next add; it is built before instances refer to it
+	accel_level& add_bottom() {
+		bottom.emplace_back(threshold);
+		return bottom.back();
+	}
+
+	// Updates every bottom level, then the top level, calling on_update(level, rebuilt) after each
+	template<class F, class G>
+	void update(scene_builder& world, F build, G on_update) {
+		for (accel_level& level : bottom)
+			on_update(level, update_accel(world, level, build));
+		on_update(top, update_accel(world, top, build));
+	}
+
+	std::vector<accel_level> bottom;
+	accel_level top;
+	float threshold;
+};
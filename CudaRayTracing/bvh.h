@@ -1,94 +1,573 @@
 #pragma once
 
 #include "hittable.h"
-#include "hittable_list.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
-class bvh_node : public hittable {
+constexpr int bvh_max_depth = 64;	///> traversal stack size, the builders never exceed it
+
+/**
+ * \brief Node of a flattened BVH, 32 bytes so two fit in a cache line.
+ * Nodes are stored depth-first: an interior node's first child directly follows it and offset holds
+ * the index of the second child; a leaf's offset is the start of its range in the primitive index array.
+ */
+struct linear_bvh_node {
+	aabb bounds;
+	int offset;
+	uint16_t num_prims;		///> 0 for interior nodes
+	uint8_t axis;			///> split axis of interior nodes, picks the near child first
+	uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+/**
+ * \brief BVH over primitives identified by index, traversed with an explicit stack.
+ * Leaves hold the primitives' indices; the caller intersects them through hit_prim, which keeps the
+ * traversal free of any knowledge of primitive types. Does not own its arrays, so the same traversal
+ * runs over host memory on the CPU backend and over device memory on CUDA.
+ */
+class linear_bvh {
 public:
-	bvh_node() {};
-	bvh_node(const hittable_list& list, float time0, float time1) :
-			bvh_node(list.objects, 0, list.objects.size(), time0, time1){};
-	bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1);
+	XPU linear_bvh() :
+			nodes(nullptr), indices(nullptr) {}
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
-	virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
+	XPU linear_bvh(const linear_bvh_node* n, const int* idx) :
+			nodes(n), indices(idx) {}
+
+	// hit_prim(int prim, const ray&, float t_min, float t_max, hit_record&) intersects one primitive
+	template<class F>
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec, F hit_prim) const;
+
+	// Host only: hit_prim(int prim, int mask, packet_float& t_max) intersects one primitive with the
+	// lanes in mask, filling their records and lowering t_max where they hit; returns the lanes hit
+	template<class F>
+	int hit_packet(const ray* rays, const packet_ray& packet, int active, float t_min, packet_float& t_max, F hit_prim) const;
+
+	XPU bool bounding_box(float time0, float time1, aabb& output_box) const {
+		output_box = nodes[0].bounds;
+		return true;
+	}
 
 public:
-	std::shared_ptr<hittable> left;
-	std::shared_ptr<hittable> right;
-	aabb box;
+	const linear_bvh_node* nodes;
+	const int* indices;
 };
 
-inline bool box_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b, int axis) {
-	aabb box_a, box_b;
+template<class F>
+XPU inline bool linear_bvh::hit(const ray& r, float t_min, float t_max, hit_record& rec, F hit_prim) const {
+	vec3 dir = r.direction();
+	vec3 inv_dir(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+	int dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
 
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-		std::cerr << "ERROR::BVH_Node: Node bounding box in bvh_node constructor. \n";
+	int stack[bvh_max_depth];
+	int stack_size = 0;
+	int current = 0;
+	bool hit_anything = false;
+	hit_record temp_rec;
 
-	return box_a.min().e[axis] < box_b.min().e[axis];
-}
+	while (true) {
+		const linear_bvh_node& node = nodes[current];
+		if (node.bounds.hit(r, inv_dir, dir_is_neg, t_min, t_max)) {
+			if (node.num_prims > 0) {
+				for (int i = 0; i < node.num_prims; i++) {
+					if (hit_prim(indices[node.offset + i], r, t_min, t_max, temp_rec)) {
+						hit_anything = true;
+						t_max = temp_rec.t;
+						rec = temp_rec;
+					}
+				}
+				if (stack_size == 0)
+					break;
+				current = stack[--stack_size];
+			} else if (dir_is_neg[node.axis]) {
+				// visit the child nearer along the split axis first, so t_max shrinks sooner
+				stack[stack_size++] = current + 1;
+				current = node.offset;
+			} else {
+				stack[stack_size++] = node.offset;
+				current = current + 1;
+			}
+		} else {
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+	}
 
-inline bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-	return box_compare(a, b, 0);
+	return hit_anything;
 }
 
-inline bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-	return box_compare(a, b, 1);
+// Slab test of one box against every lane; returns the mask of lanes whose [t_min, t_max] overlaps it
+inline int packet_box_hit(const aabb& box, const packet_ray& packet, const packet_vec3& inv_dir, const packet_mask dir_is_neg[3],
+		packet_float t_min, packet_float t_max) {
+	packet_float lo[3] = { box.min().x(), box.min().y(), box.min().z() };
+	packet_float hi[3] = { box.max().x(), box.max().y(), box.max().z() };
+	const packet_float* orig[3] = { &packet.orig.x, &packet.orig.y, &packet.orig.z };
+	const packet_float* inv[3] = { &inv_dir.x, &inv_dir.y, &inv_dir.z };
+
+	for (int a = 0; a < 3; a++) {
+		packet_float t0 = (select(dir_is_neg[a], hi[a], lo[a]) - *orig[a]) * *inv[a];
+		packet_float t1 = (select(dir_is_neg[a], lo[a], hi[a]) - *orig[a]) * *inv[a];
+		t_min = max(t0, t_min);
+		t_max = min(t1, t_max);
+	}
+	return (t_min <= t_max).bits();
 }
 
-inline bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-	return box_compare(a, b, 2);
+template<class F>
+inline int linear_bvh::hit_packet(const ray* rays, const packet_ray& packet, int active, float t_min, packet_float& t_max, F hit_prim) const {
+	const packet_float one(1.0f), zero(0.0f), tmin(t_min);
+	packet_vec3 inv_dir(one / packet.dir.x, one / packet.dir.y, one / packet.dir.z);
+	packet_mask dir_is_neg[3] = { inv_dir.x < zero, inv_dir.y < zero, inv_dir.z < zero };
+
+	// the packet shares one traversal order, taken from its first active ray
+	int lead = 0;
+	while (!(active >> lead & 1))
+		lead++;
+	vec3 lead_dir = rays[lead].direction();
+	int lead_is_neg[3] = { 1.0f / lead_dir.x() < 0, 1.0f / lead_dir.y() < 0, 1.0f / lead_dir.z() < 0 };
+
+	int stack[bvh_max_depth];
+	int stack_size = 0;
+	int current = 0;
+	int hit_mask = 0;
+
+	while (true) {
+		const linear_bvh_node& node = nodes[current];
+		int mask = active & packet_box_hit(node.bounds, packet, inv_dir, dir_is_neg, tmin, t_max);
+		if (mask != 0) {
+			if (node.num_prims > 0) {
+				for (int i = 0; i < node.num_prims; i++) {
+					hit_mask |= hit_prim(indices[node.offset + i], mask, t_max);
+				}
+				if (stack_size == 0)
+					break;
+				current = stack[--stack_size];
+			} else if (lead_is_neg[node.axis]) {
+				stack[stack_size++] = current + 1;
+				current = node.offset;
+			} else {
+				stack[stack_size++] = node.offset;
+				current = current + 1;
+			}
+		} else {
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+	}
+
+	return hit_mask;
 }
 
-inline bvh_node::bvh_node(const std::vector<std::shared_ptr<hittable>>& src_objects, size_t start, size_t end, float time0, float time1) {
-	auto objects = src_objects;		// copy list of objects that can now be modified
+/*
+ * ----------------------------------------------
+ * Host-side construction
+ */
+
+/**
+ * \brief Output shared by the BVH builders: the flat node array, the primitive index array its leaves
+ * point into, and statistics for the render log
+ */
+struct bvh_build_result {
+	std::vector<linear_bvh_node> nodes;
+	std::vector<int> indices;
+
+	double build_ms = 0;
+	int max_depth = 0;
+	int num_leaves = 0;
+	unsigned int build_threads = 1;
+
+	// relative costs used by the SAH, one primitive intersection is the unit
+	static constexpr float traversal_cost = 1.0f;
+	static constexpr float intersection_cost = 1.0f;
+
+	// Expected cost of tracing a ray through the tree, in units of one primitive intersection
+	float sah_cost() const;
 
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare
-			: (axis == 1)		  ? box_y_compare
-								  : box_z_compare;
+	// Recomputes the node bounds after the primitives moved, keeping the tree topology
+	void refit(const std::vector<aabb>& boxes);
+};
+
+inline float bvh_build_result::sah_cost() const {
+	float root_area = nodes[0].bounds.surface_area();
+	if (!(root_area > 0.0f))
+		return 0.0f;
 
-	size_t object_span = end - start;
+	// probability of visiting a node is its area relative to the root for uniformly distributed rays
+	float cost = 0.0f;
+	for (const linear_bvh_node& node : nodes) {
+		float p = node.bounds.surface_area() / root_area;
+		cost += node.num_prims > 0 ? p * node.num_prims * intersection_cost : p * traversal_cost;
+	}
+	return cost;
+}
 
-	if (object_span == 1) {
-		left = right = objects[start];
-	} else if (object_span == 2) {
-		if (comparator(objects[start], objects[start + 1])) {
-			left = objects[start];
-			right = objects[start + 1];
+inline void bvh_build_result::refit(const std::vector<aabb>& boxes) {
+	// the empty tree is a single leaf without primitives, which the sweep would take for an interior node
+	if (indices.empty())
+		return;
+
+	// children always come after their parent in the depth-first layout, so a reverse sweep is bottom-up
+	for (size_t i = nodes.size(); i-- > 0;) {
+		linear_bvh_node& node = nodes[i];
+		if (node.num_prims > 0) {
+			aabb bounds = aabb::empty();
+			for (int p = 0; p < node.num_prims; p++)
+				bounds = surrounding_box(bounds, boxes[indices[node.offset + p]]);
+			node.bounds = bounds;
 		} else {
-			left = objects[start + 1];
-			right = objects[start];
+			node.bounds = surrounding_box(nodes[i + 1].bounds, nodes[node.offset].bounds);
 		}
+	}
+}
+
+/**
+ * \brief BVH over moving primitives. Every update refits the current tree, and it is only rebuilt
+ * when the refitted SAH cost grows past rebuild_threshold times the cost right after the last build.
+ */
+class dynamic_bvh {
+public:
+	explicit dynamic_bvh(float threshold = 1.3f) :
+			rebuild_threshold(threshold) {}
+
+	// Brings the tree up to date with the new primitive bounds, calling build(boxes) for a full
+	// rebuild. Returns true after a rebuild, which changes the node count and the primitive order;
+	// after a refit only the node bounds changed.
+	template<class F>
+	bool update(const std::vector<aabb>& boxes, F build);
+
+	const bvh_build_result& tree() const { return bvh; }
+
+	// SAH cost of the current tree relative to the tree produced by the last build
+	float cost_ratio() const { return built_cost > 0.0f ? current_cost / built_cost : 1.0f; }
+
+public:
+	float rebuild_threshold;
+	double update_ms = 0;
+	int num_refits = 0;
+	int num_rebuilds = 0;
+
+private:
+	bvh_build_result bvh;
+	float built_cost = 0.0f;
+	float current_cost = 0.0f;
+};
+
+template<class F>
+inline bool dynamic_bvh::update(const std::vector<aabb>& boxes, F build) {
+	auto start = std::chrono::steady_clock::now();
+
+	bool rebuild = bvh.nodes.empty() || bvh.indices.size() != boxes.size();
+	if (!rebuild) {
+		bvh.refit(boxes);
+		current_cost = bvh.sah_cost();
+		rebuild = current_cost > rebuild_threshold * built_cost;
+		if (!rebuild)
+			num_refits++;
+	}
+
+	if (rebuild) {
+		bvh = build(boxes);
+		built_cost = current_cost = bvh.sah_cost();
+		num_rebuilds++;
+	}
+
+	update_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return rebuild;
+}
+
+enum class bvh_split_method {
+	median,		///> object median along the widest centroid axis
+	sah			///> binned surface area heuristic
+};
+
+/**
+ * \brief Builds a flattened BVH from primitive bounding boxes on the host.
+ * Works in place on one primitive index array; the result can be used directly on the CPU backend
+ * or copied to device memory. Given a thread pool, subtrees above parallel_cutoff primitives are
+ * built as separate jobs into their own node arrays and stitched together at the end.
+ */
+class bvh_builder : public bvh_build_result {
+public:
+	bvh_builder(const std::vector<aabb>& prim_boxes, int leaf_size = 4, bvh_split_method method = bvh_split_method::sah, int bins = 16) :
+			boxes(prim_boxes),
+			max_leaf_size(std::max(1, std::min(leaf_size, 0xffff))),
+			split_method(method),
+			num_bins(std::max(2, std::min(bins, max_bins))) {}
+
+	void build(thread_pool* pool = nullptr);
+
+public:
+	static constexpr int max_bins = 64;
+	static constexpr int parallel_cutoff = 4096;
+
+private:
+	struct build_stats {
+		int max_depth = 0;
+		int num_leaves = 0;
+	};
+
+	// Top of the tree when building in parallel: either an interior node with two subtrees, or a
+	// subtree built serially by one job (children empty)
+	struct subtree {
+		linear_bvh_node node{};
+		std::unique_ptr<subtree> children[2];
+		std::vector<linear_bvh_node> nodes;
+		build_stats stats;
+	};
+
+	std::unique_ptr<subtree> build_task(thread_pool* pool, int start, int end, int depth);
+	void flatten(subtree& sub);
+	int build_recursive(std::vector<linear_bvh_node>& out, build_stats& stats, int start, int end, int depth);
+	int partition(int start, int end, int depth, linear_bvh_node& node);
+	int split_median(int start, int end, int axis);
+	int split_sah(int start, int end, const aabb& node_bounds, const aabb& centroids, int& axis);
+	aabb range_bounds(int start, int end) const;
+	aabb centroid_bounds(int start, int end) const;
+
+	const std::vector<aabb>& boxes;
+	std::vector<point3> centers;
+	int max_leaf_size;
+	bvh_split_method split_method;
+	int num_bins;
+};
+
+inline void bvh_builder::build(thread_pool* pool) {
+	auto start = std::chrono::steady_clock::now();
+	nodes.clear();
+	max_depth = 0;
+	num_leaves = 0;
+	build_threads = pool ? pool->num_threads() : 1;
+	indices.resize(boxes.size());
+	centers.resize(boxes.size());
+	for (size_t i = 0; i < boxes.size(); i++) {
+		indices[i] = static_cast<int>(i);
+		centers[i] = boxes[i].centroid();
+	}
+
+	if (boxes.empty()) {
+		// single empty leaf so traversal never needs a special case
+		linear_bvh_node leaf{};
+		leaf.bounds = aabb::empty();
+		nodes.push_back(leaf);
+		num_leaves = 1;
 	} else {
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
+		nodes.reserve(2 * boxes.size() / max_leaf_size + 1);
+		std::unique_ptr<subtree> root = build_task(pool, 0, static_cast<int>(boxes.size()), 0);
+		flatten(*root);
+	}
+
+	centers.clear();
+	centers.shrink_to_fit();
+	build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline aabb bvh_builder::range_bounds(int start, int end) const {
+	aabb bounds = aabb::empty();
+	for (int i = start; i < end; i++)
+		bounds = surrounding_box(bounds, boxes[indices[i]]);
+	return bounds;
+}
+
+inline aabb bvh_builder::centroid_bounds(int start, int end) const {
+	aabb bounds = aabb::empty();
+	for (int i = start; i < end; i++)
+		bounds = surrounding_box(bounds, centers[indices[i]]);
+	return bounds;
+}
+
+inline std::unique_ptr<bvh_builder::subtree> bvh_builder::build_task(thread_pool* pool, int start, int end, int depth) {
+	auto sub = std::make_unique<subtree>();
+	if (!pool || end - start <= parallel_cutoff) {
+		build_recursive(sub->nodes, sub->stats, start, end, depth);
+		return sub;
+	}
+
+	sub->stats.max_depth = depth;
+	int mid = partition(start, end, depth, sub->node);
+	if (mid == end) {
+		sub->node.offset = start;
+		sub->node.num_prims = static_cast<uint16_t>(end - start);
+		sub->nodes.push_back(sub->node);
+		sub->stats.num_leaves = 1;
+		return sub;
+	}
+
+	// the left half goes to the pool, this thread carries on with the right half and then helps
+	// with queued jobs until the left half is done
+	auto left = pool->queue_job([this, pool, start, mid, depth] { return build_task(pool, start, mid, depth + 1); });
+	sub->children[1] = build_task(pool, mid, end, depth + 1);
+	while (left.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		if (!pool->run_pending_job())
+			std::this_thread::yield();
+	}
+	sub->children[0] = left.get();
+	return sub;
+}
 
-		size_t mid = start + object_span / 2;
-		left = std::make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = std::make_shared<bvh_node>(objects, mid, end, time0, time1);
+inline void bvh_builder::flatten(subtree& sub) {
+	if (!sub.children[0]) {
+		// serially built nodes reference each other relative to their own array
+		int base = static_cast<int>(nodes.size());
+		for (linear_bvh_node node : sub.nodes) {
+			if (node.num_prims == 0)
+				node.offset += base;
+			nodes.push_back(node);
+		}
+		max_depth = std::max(max_depth, sub.stats.max_depth);
+		num_leaves += sub.stats.num_leaves;
+		return;
 	}
 
-	aabb box_left, box_right;
+	int node_index = static_cast<int>(nodes.size());
+	nodes.push_back(sub.node);
+	max_depth = std::max(max_depth, sub.stats.max_depth);
+	flatten(*sub.children[0]);
+	nodes[node_index].offset = static_cast<int>(nodes.size());
+	flatten(*sub.children[1]);
+}
 
-	if (!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0, time1, box_right))
-		std::cerr << "ERROR::BVH_Node: Node bounding box in bvh_node constructor. \n";
+inline int bvh_builder::build_recursive(std::vector<linear_bvh_node>& out, build_stats& stats, int start, int end, int depth) {
+	int node_index = static_cast<int>(out.size());
+	out.emplace_back();
+	linear_bvh_node node{};
+	stats.max_depth = std::max(stats.max_depth, depth);
 
-	box = surrounding_box(box_left, box_right);
+	int mid = partition(start, end, depth, node);
+	if (mid == end) {
+		node.offset = start;
+		node.num_prims = static_cast<uint16_t>(end - start);
+		out[node_index] = node;
+		stats.num_leaves++;
+		return node_index;
+	}
+
+	build_recursive(out, stats, start, mid, depth + 1);
+	node.offset = build_recursive(out, stats, mid, end, depth + 1);
+	out[node_index] = node;
+	return node_index;
 }
 
-inline bool bvh_node::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-	if (!box.hit(r, t_min, t_max))
-		return false;
+/**
+ * \brief Computes the bounds of [start, end) and partitions it in place.
+ * Returns the partition point, or end when the range should become a leaf. Only touches its own
+ * range of the index array, so disjoint ranges can be partitioned concurrently.
+ */
+inline int bvh_builder::partition(int start, int end, int depth, linear_bvh_node& node) {
+	node.bounds = range_bounds(start, end);
+	node.num_prims = 0;
+
+	int count = end - start;
+	aabb centroids = centroid_bounds(start, end);
+	vec3 extent = centroids.max() - centroids.min();
+	int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
 
-	bool hit_left = left->hit(r, t_min, t_max, rec);
-	bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+	// leaf for single primitives, when all centroids coincide, or when the stack limit is near
+	if (count == 1 || ((extent[axis] <= 0.0f || depth >= bvh_max_depth - 1) && count <= 0xffff))
+		return end;
 
-	return hit_left || hit_right;
+	int mid = -1;
+	if (split_method == bvh_split_method::sah) {
+		mid = split_sah(start, end, node.bounds, centroids, axis);
+		if (mid == end)
+			return end;
+	} else if (count <= max_leaf_size) {
+		return end;
+	}
+
+	if (mid <= start || mid >= end)
+		mid = split_median(start, end, axis);
+
+	node.axis = static_cast<uint8_t>(axis);
+	return mid;
 }
 
-inline bool bvh_node::bounding_box(float time0, float time1, aabb& output_box) const {
-	output_box = box;
-	return true;
+inline int bvh_builder::split_median(int start, int end, int axis) {
+	int mid = start + (end - start) / 2;
+	std::nth_element(indices.begin() + start, indices.begin() + mid, indices.begin() + end, [&](int a, int b) {
+		return centers[a][axis] < centers[b][axis];
+	});
+	return mid;
+}
+
+/**
+ * \brief Bins the centroids on every axis and partitions at the cheapest bin boundary.
+ * Returns the partition point and the chosen axis, end when a leaf is cheaper than any split
+ * (only allowed within the leaf size limit), or -1 when no bin boundary separates the primitives.
+ */
+inline int bvh_builder::split_sah(int start, int end, const aabb& node_bounds, const aabb& centroids, int& axis) {
+	struct bin {
+		aabb bounds = aabb::empty();
+		int count = 0;
+	};
+
+	int count = end - start;
+	float best_cost = infinity;
+	int best_axis = -1;
+	int best_split = 0;
+
+	for (int a = 0; a < 3; a++) {
+		float cmin = centroids.min()[a];
+		float extent = centroids.max()[a] - cmin;
+		if (extent <= 0.0f)
+			continue;
+
+		bin bins[max_bins];
+		float scale = num_bins / extent;
+		for (int i = start; i < end; i++) {
+			int b = std::min(num_bins - 1, static_cast<int>((centers[indices[i]][a] - cmin) * scale));
+			bins[b].count++;
+			bins[b].bounds = surrounding_box(bins[b].bounds, boxes[indices[i]]);
+		}
+
+		// sweep from the right to get the area and count above every boundary, then from the left
+		float right_area[max_bins];
+		aabb right = aabb::empty();
+		int right_count = 0;
+		for (int b = num_bins - 1; b > 0; b--) {
+			right = surrounding_box(right, bins[b].bounds);
+			right_count += bins[b].count;
+			right_area[b] = right_count > 0 ? right.surface_area() * right_count : 0.0f;
+		}
+
+		aabb left = aabb::empty();
+		int left_count = 0;
+		for (int b = 0; b < num_bins - 1; b++) {
+			left = surrounding_box(left, bins[b].bounds);
+			left_count += bins[b].count;
+			if (left_count == 0 || left_count == count)
+				continue;
+
+			float cost = left.surface_area() * left_count + right_area[b + 1];
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = a;
+				best_split = b;
+			}
+		}
+	}
+
+	if (best_axis < 0)
+		return -1;
+
+	float area = node_bounds.surface_area();
+	best_cost = traversal_cost + (area > 0.0f ? intersection_cost * best_cost / area : intersection_cost * count);
+	if (count <= max_leaf_size && best_cost >= intersection_cost * count)
+		return end;
+
+	axis = best_axis;
+	float cmin = centroids.min()[axis];
+	float scale = num_bins / (centroids.max()[axis] - cmin);
+	auto it = std::partition(indices.begin() + start, indices.begin() + end, [&](int i) {
+		int b = std::min(num_bins - 1, static_cast<int>((centers[i][axis] - cmin) * scale));
+		return b <= best_split;
+	});
+	return static_cast<int>(it - indices.begin());
 }
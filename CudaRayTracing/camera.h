@@ -6,7 +6,7 @@
 
 class camera {
 public:
-	GPU camera() {
+	XPU camera() {
         lower_left_corner = vec3(-2.0, -1.0, -1.0);
         horizontal = vec3(4.0, 0.0, 0.0);
         vertical = vec3(0.0, 2.0, 0.0);
@@ -17,7 +17,8 @@ public:
 		time0 = time1 = 0;
     }
 
-	GPU camera(point3 lookfrom, point3 lookat, point3 vup, float fov, float aspect_ratio, float aperture, float focus_dist, float t0 = 0, float t1 = 0) :
+	// Built on the host with the rest of the scene and passed to the render kernel by value
+	XPU camera(point3 lookfrom, point3 lookat, point3 vup, float fov, float aspect_ratio, float aperture, float focus_dist, float t0 = 0, float t1 = 0) :
 			origin(lookfrom),
 			lens_radius(aperture / 2),
 			time0(t0),
@@ -26,21 +27,22 @@ public:
 		float h = tan(theta / 2.0f);
 		float viewport_width = 2.0f * h;
 		float viewport_height = viewport_width / aspect_ratio;
-		float focal_length = 1.0f;
 
-		w = cu_unit_vector(lookfrom - lookat);
-		u = cu_unit_vector(cross(vup, w));
-		v = cu_unit_vector(cross(w, u));
+		w = unit_vector(lookfrom - lookat);
+		u = unit_vector(cross(vup, w));
+		v = unit_vector(cross(w, u));
 
 		horizontal = focus_dist * viewport_width * u;
 		vertical = focus_dist * viewport_height * v;
 		lower_left_corner = origin - horizontal / 2 - vertical / 2 - focus_dist * w;
 	}
 
-	GPU ray get_ray(float s, float t, curandState* local_rand) const {
+	GPU ray get_ray(float s, float t, rng* local_rand) const {
+		local_rand->start_slot(slot_lens);
 		vec3 rand = lens_radius * cu_random_in_unit_disk(local_rand);
 		vec3 offset = u * rand.x() + v * rand.y();
 
+		local_rand->start_slot(slot_time);
 		return ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset, cu_random_float(time0, time1, local_rand));
 	}
 
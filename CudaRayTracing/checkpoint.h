@@ -0,0 +1,85 @@
+#pragma once
+
+#include "integrator.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+/**
+ * \brief What a checkpoint has to match to be resumed: image size, scene and its seed, how lights are sampled, the path
+ * settings that change the samples and the layout of pixel_accum.
+ * The sample count is left out on purpose, so a stopped render can be resumed with a different one.
+ * Only 4-byte fields, so the struct has no padding and is compared as raw bytes.
+ */
+struct checkpoint_key {
+	int width;
+	int height;
+	int scene_id;
+	int scene_seed;
+	int light_mode;
+	int max_depth;
+	int rr_min_depth;
+	int next_event;
+	int min_samples;
+	int sampler;
+	float sky;
+	float noise_target;
+	int pixel_size;
+};
+
+inline checkpoint_key make_checkpoint_key(int width, int height, int scene_id, int scene_seed, light_sampling lights,
+		const path_settings& settings) {
+	return { width, height, scene_id, scene_seed, int(lights), settings.max_depth, settings.rr_min_depth, settings.next_event ? 1 : 0, settings.min_samples,
+			int(settings.sampler), settings.sky, settings.noise_target, int(sizeof(pixel_accum)) };
+}
+
+const char checkpoint_magic[8] = { 'R', 'T', 'C', 'K', 'P', 'T', '0', '1' };
+
+/*
+ * File layout: magic, checkpoint_key, samples per pixel reached, then the film as raw pixel_accum.
+ * Written to a temporary file first and renamed, so a render killed while saving keeps the old checkpoint.
+ */
+inline bool save_checkpoint(const char* path, const checkpoint_key& key, int samples, const pixel_accum* film, int num_pixels) {
+	std::string tmp = std::string(path) + ".tmp";
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(checkpoint_magic, sizeof(checkpoint_magic), 1, f) == 1
+			&& fwrite(&key, sizeof(key), 1, f) == 1
+			&& fwrite(&samples, sizeof(samples), 1, f) == 1
+			&& fwrite(film, sizeof(pixel_accum), num_pixels, f) == size_t(num_pixels);
+	ok = fclose(f) == 0 && ok;
+
+	// rename does not replace an existing file on Windows
+	std::remove(path);
+	if (!ok || std::rename(tmp.c_str(), path) != 0) {
+		std::remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Fills film and samples from the checkpoint at path; false if there is none or it belongs to another render
+inline bool load_checkpoint(const char* path, const checkpoint_key& key, int& samples, pixel_accum* film, int num_pixels) {
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	char magic[sizeof(checkpoint_magic)];
+	checkpoint_key file_key;
+	bool ok = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, checkpoint_magic, sizeof(magic)) == 0
+			&& fread(&file_key, sizeof(file_key), 1, f) == 1 && memcmp(&file_key, &key, sizeof(key)) == 0;
+	if (!ok) {
+		fclose(f);
+		std::cerr << "Checkpoint " << path << " belongs to a different render, starting over" << std::endl;
+		return false;
+	}
+
+	ok = fread(&samples, sizeof(samples), 1, f) == 1 && fread(film, sizeof(pixel_accum), num_pixels, f) == size_t(num_pixels);
+	fclose(f);
+	if (!ok)
+		std::cerr << "Checkpoint " << path << " is truncated, starting over" << std::endl;
+	return ok;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "hittable.h"
+
+/**
+ * \brief Affine transform stored as the top 3 rows of a 4x4 matrix (rotation/scale in the left 3x3,
+ * translation in the last column)
+ */
+struct affine_transform {
+	float m[3][4];
+
+	XPU affine_transform() :
+			m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+
+	XPU point3 apply_point(const point3& p) const {
+		return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+				m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+				m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	XPU vec3 apply_vector(const vec3& v) const {
+		return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+				m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+				m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	// Applies the transpose of the 3x3 part; with the inverse transform this maps normals
+	XPU vec3 apply_transposed(const vec3& v) const {
+		return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+				m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+				m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+	}
+
+	XPU affine_transform inverse() const;
+
+	XPU static affine_transform translate(const vec3& offset) {
+		affine_transform t;
+		t.m[0][3] = offset.x();
+		t.m[1][3] = offset.y();
+		t.m[2][3] = offset.z();
+		return t;
+	}
+
+	XPU static affine_transform scale(float s) {
+		affine_transform t;
+		t.m[0][0] = t.m[1][1] = t.m[2][2] = s;
+		return t;
+	}
+
+	XPU static affine_transform rotate_y(float angle) {
+		// rotation about the y axis by angle degrees, x toward -z
+		float radians = degrees_to_radians(angle);
+		float sin_theta = sin(radians);
+		float cos_theta = cos(radians);
+		affine_transform t;
+		t.m[0][0] = cos_theta;
+		t.m[0][2] = sin_theta;
+		t.m[2][0] = -sin_theta;
+		t.m[2][2] = cos_theta;
+		return t;
+	}
+};
+
+// Composition: (a * b) applies b first, then a
+XPU inline affine_transform operator*(const affine_transform& a, const affine_transform& b) {
+	affine_transform r;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+		}
+		r.m[i][3] += a.m[i][3];
+	}
+	return r;
+}
+
+XPU inline affine_transform affine_transform::inverse() const {
+	// inverse of the 3x3 part from its cofactors, then the translation moved through it
+	float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	float inv_det = 1.0f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+	affine_transform r;
+	r.m[0][0] = c00 * inv_det;
+	r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+	r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+	r.m[1][0] = c01 * inv_det;
+	r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+	r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+	r.m[2][0] = c02 * inv_det;
+	r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+	r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+	vec3 t = r.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+	r.m[0][3] = -t.x();
+	r.m[1][3] = -t.y();
+	r.m[2][3] = -t.z();
+	return r;
+}
+
+/**
+ * \brief One placement of shared geometry: a bottom-level BVH of the scene, referred to by index.
+ * A top-level BVH over instances only stores the transforms, so repeated objects cost memory for
+ * their unique geometry once.
+ */
+class instance {
+public:
+	XPU instance(int object_bvh, const affine_transform& transform) :
+			bvh(object_bvh), to_world(transform), to_object(transform.inverse()) {}
+
+	// hit_object(const ray&, float t_min, float t_max, hit_record&) traces a ray in object space
+	template<class F>
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec, F hit_object) const;
+
+	// World space bounds of the placed object, given its object space bounds
+	XPU aabb world_bounds(const aabb& box) const;
+
+public:
+	int bvh;
+	affine_transform to_world;
+	affine_transform to_object;
+};
+
+template<class F>
+XPU inline bool instance::hit(const ray& r, float t_min, float t_max, hit_record& rec, F hit_object) const {
+	// the direction is transformed without normalizing, so t means the same in both spaces
+	ray object_r(to_object.apply_point(r.origin()), to_object.apply_vector(r.direction()), r.time());
+	if (!hit_object(object_r, t_min, t_max, rec))
+		return false;
+
+	vec3 outward_normal = rec.front_face ? rec.normal : -rec.normal;
+	rec.p = r.at(rec.t);
+	rec.set_face_normal(r, unit_vector(to_object.apply_transposed(outward_normal)));
+	return true;
+}
+
+XPU inline aabb instance::world_bounds(const aabb& box) const {
+	aabb output_box = aabb::empty();
+	for (int i = 0; i < 8; i++) {
+		point3 corner((i & 1) ? box.max().x() : box.min().x(),
+				(i & 2) ? box.max().y() : box.min().y(),
+				(i & 4) ? box.max().z() : box.min().z());
+		output_box = surrounding_box(output_box, to_world.apply_point(corner));
+	}
+	return output_box;
+}
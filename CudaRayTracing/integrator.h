@@ -0,0 +1,687 @@
+#pragma once
+
+#include "camera.h"
+#include "lbvh.h"
+#include "pdf.h"
+#include "scene.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+/**
+ * \brief Path tracing and pixel sampling controls, set at runtime and passed by value to the render kernels
+ */
+struct path_settings {
+	int max_depth = 10;			///> hits evaluated per path before it is cut off
+	int rr_min_depth = 3;		///> bounces before Russian roulette may end a path; >= max_depth disables it
+	bool next_event = true;		///> shadow ray to a light at every diffuse hit, MIS-weighted against BSDF sampling;
+								///> otherwise bounces sample the 50/50 mixture of light and cosine pdfs
+	float sky = 1.0f;			///> scale of the background gradient; 0 for scenes lit only by their emitters
+	int min_samples = 64;		///> samples every pixel takes before adaptive sampling may stop it; fewer miss rare light paths
+	float noise_target = 0;		///> relative standard error at which a pixel stops; 0 takes every sample
+	sampler_type sampler = sampler_type::sobol;	///> how the numbers of a sample are drawn; see rng
+};
+
+XPU inline float luminance(const color& c) {
+	return 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+}
+
+/**
+ * \brief Running mean and variance of a pixel's sample luminance (Welford's method), which decide when
+ * adaptive sampling has reached the noise target
+ */
+struct pixel_stats {
+	int n = 0;
+	float mean = 0;
+	float m2 = 0;
+
+	XPU void add(const color& sample) {
+		float y = luminance(sample);
+		n++;
+		float delta = y - mean;
+		mean += delta / n;
+		m2 += delta * (y - mean);
+	}
+
+	// Standard error of the mean below noise_target relative to the mean; the 0.05 floor lets pixels
+	// near black stop as well instead of always taking every sample
+	XPU bool converged(const path_settings& settings) const {
+		if (settings.noise_target <= 0 || n < settings.min_samples || n < 2)
+			return false;
+		float variance = m2 / (n - 1);
+		return sqrtf(variance / n) <= settings.noise_target * (mean + 0.05f);
+	}
+};
+
+/**
+ * \brief Everything a pixel carries from one render pass to the next: the sum of its samples and their
+ * statistics. A film of these is what a checkpoint stores; the random numbers of the next sample follow
+ * from the pixel and stats.n alone (see sample_rng).
+ */
+struct pixel_accum {
+	color sum;
+	pixel_stats stats;
+
+	// Whether the pixel takes more samples in a pass that brings every pixel up to `samples`
+	XPU bool wants_samples(int samples, const path_settings& settings) const {
+		return stats.n < samples && !stats.converged(settings);
+	}
+};
+
+// Random stream of the pixel's next sample, so tile order, thread count and pass length do not change the image
+XPU inline rng sample_rng(int pixel, const pixel_accum& accum, const path_settings& settings) {
+	return rng(pixel, accum.stats.n, settings.sampler);
+}
+
+// Russian roulette after `depth` bounces: ends low-throughput paths at random and scales the survivors
+// by the inverse survival probability, so the estimate stays unbiased. Returns false if the path ends.
+GPU inline bool survive_roulette(color& throughput, int depth, const path_settings& settings, rng* local_rand) {
+	if (depth < settings.rr_min_depth)
+		return true;
+
+	// capped so even bright paths are ended now and then; their weight stays bounded by 1 / 0.95
+	float p = fminf(luminance(throughput), 0.95f);
+	local_rand->start_slot(slot_roulette);
+	if (!(cu_random_float(local_rand) <= p))
+		return false;
+	throughput /= p;
+	return true;
+}
+
+GPU inline color background(const ray& r, float scale) {
+	vec3 unit_direction = unit_vector(r.direction());
+	float t = 0.5f * (unit_direction.y() + 1.0f);
+	return scale * ((1.0f - t) * vec3(1.0f, 1.0f, 1.0f) + t * vec3(0.5f, 0.7f, 1.0f));
+}
+
+// Weight of the sample drawn with pdf_a when the same direction could also have come from pdf_b
+GPU inline float power_heuristic(float pdf_a, float pdf_b) {
+	float a2 = pdf_a * pdf_a;
+	float b2 = pdf_b * pdf_b;
+	return a2 > 0 ? a2 / (a2 + b2) : 0.0f;
+}
+
+/**
+ * \brief Where the ray currently traced was scattered, kept to MIS-weight the emission it finds
+ */
+struct path_vertex {
+	point3 p;
+	float bsdf_pdf = 0;		///> solid angle pdf the ray was sampled with; 0 for camera and specular rays
+};
+
+/**
+ * \brief Shadow ray toward a sampled light point and what it carries if nothing blocks it
+ */
+struct light_sample {
+	ray shadow;
+	color weight;			///> throughput * BSDF * MIS weight / light pdf, times the emission the ray reaches
+};
+
+/*
+ * The stages of one bounce, shared by the megakernel loop and the wavefront stages.
+ * r is the camera ray of the path, which emitted() and scattering_pdf() are given as in the original
+ * integrator.
+ */
+
+// Evaluates the material at a hit: returns false when the path ends there, with its emission in emitted,
+// otherwise the material's own sample in scattered and pdf_val
+GPU inline bool shade_hit(const ray& r, const ray& cur_ray, const hit_record& rec, const scene& world, color& attenuation, color& emitted,
+		ray& scattered, float& pdf_val, rng* local_rand) {
+	const material& mat = world.material_at(rec);
+	emitted = mat.emitted(r, rec, world.textures, rec.u, rec.v, rec.p);
+	return mat.scatter(cur_ray, rec, world.textures, attenuation, scattered, pdf_val, local_rand);
+}
+
+// MIS weight of emission hit by cur_ray; the light sampler could have found it from prev as well
+GPU inline float emission_weight(const path_vertex& prev, const ray& cur_ray, const scene& world) {
+	if (prev.bsdf_pdf == 0)
+		return 1.0f;
+	return power_heuristic(prev.bsdf_pdf, world.light_pdf_value(prev.p, cur_ray.direction()));
+}
+
+// Next event estimation: picks a direction toward the lights from a diffuse hit. Assumes the material
+// samples proportionally to scattering_pdf, so the same value is its BSDF * cosine and its pdf.
+GPU inline bool sample_light(const ray& r, const hit_record& rec, const color& attenuation, const color& throughput, const scene& world,
+		light_sample& sample, rng* local_rand) {
+	const material& mat = world.material_at(rec);
+	if (mat.is_specular())
+		return false;
+
+	local_rand->start_slot(slot_light_select);
+	vec3 direction = world.light_random(rec.p, local_rand);
+	if (direction.length_squared() == 0)
+		return false; // no light can reach rec.p
+	direction = unit_vector(direction);
+	float light_pdf = world.light_pdf_value(rec.p, direction);
+	if (light_pdf <= 0)
+		return false;
+
+	sample.shadow = ray(rec.p, direction, r.time());
+	float bsdf_pdf = mat.scattering_pdf(r, rec, sample.shadow);
+	if (bsdf_pdf <= 0)
+		return false;
+
+	sample.weight = throughput * attenuation * bsdf_pdf * power_heuristic(light_pdf, bsdf_pdf) / light_pdf;
+	return true;
+}
+
+// Light reaching the shadow ray's origin: the emission of the first surface it hits, which is the
+// sampled light unless an occluder (emitting nothing) is in the way
+GPU inline color trace_shadow(light_sample& sample, const scene& world, rng* local_rand) {
+	hit_record rec;
+	local_rand->start_slot(slot_shadow_medium);
+	if (!world.hit(sample.shadow, 0.001f, FLT_MAX, rec, local_rand))
+		return color(0, 0, 0);
+	return sample.weight * world.material_at(rec).emitted(sample.shadow, rec, world.textures, rec.u, rec.v, rec.p);
+}
+
+// Continues the path along the material's own sample; returns false if that sample is degenerate
+GPU inline bool continue_path(const ray& r, const hit_record& rec, const scene& world, const color& attenuation, const ray& scattered,
+		float pdf_val, color& throughput, ray& cur_ray, path_vertex& prev) {
+	const material& mat = world.material_at(rec);
+	prev.p = rec.p;
+	if (mat.is_specular()) {
+		throughput *= attenuation;
+		prev.bsdf_pdf = 0;
+	} else {
+		if (!(pdf_val > 0))
+			return false;
+		throughput *= attenuation * mat.scattering_pdf(r, rec, scattered) / pdf_val;
+		prev.bsdf_pdf = pdf_val;
+	}
+	cur_ray = scattered;
+	return true;
+}
+
+// Samples the continuation of a scattering path from the mixture of light and cosine pdfs; false ends the path
+GPU inline bool connect_lights(const ray& r, const hit_record& rec, const color& attenuation, const scene& world, color& throughput, ray& cur_ray,
+		rng* local_rand) {
+	light_pdf<scene> p0(rec.p, world);
+	cosine_pdf p1(rec.normal);
+	mixture_pdf<light_pdf<scene>, cosine_pdf> mixed_pdf(p0, p1);
+
+	ray scattered = ray(rec.p, mixed_pdf.generate(local_rand), r.time());
+	if (scattered.direction().length_squared() == 0)
+		return false; // the light half found no light that can reach rec.p
+	float pdf_val = mixed_pdf.value(scattered.direction());
+	if (!(pdf_val > 0))
+		return false;
+
+	throughput *= attenuation * world.material_at(rec).scattering_pdf(r, rec, scattered) / pdf_val;
+	cur_ray = scattered;
+	return true;
+}
+
+// Follows a path whose first intersection is already known: rec holds it when hit is set
+GPU inline color trace_path(const ray& r, bool hit, hit_record rec, const scene& world, const path_settings& settings, rng* local_rand) {
+	ray cur_ray = r;
+	vec3 cur_attenuation = vec3(1.0, 1.0, 1.0);
+	color radiance(0, 0, 0);
+	path_vertex prev;
+
+	for (int i = 0; i < settings.max_depth; i++) {
+		if (i > 0) {
+			rec = hit_record();
+			local_rand->start_slot(slot_medium);
+			hit = world.hit(cur_ray, 0.001f, FLT_MAX, rec, local_rand);
+		}
+		if (!hit) {
+			return radiance + cur_attenuation * background(cur_ray, settings.sky);
+		}
+
+		color attenuation, emitted;
+		ray scattered;
+		float pdf_val;
+		local_rand->start_bounce(i + 1);
+		if (!shade_hit(r, cur_ray, rec, world, attenuation, emitted, scattered, pdf_val, local_rand)) {
+			return radiance + cur_attenuation * emitted * emission_weight(prev, cur_ray, world);
+		}
+
+		if (settings.next_event) {
+			light_sample shadow;
+			if (sample_light(r, rec, attenuation, cur_attenuation, world, shadow, local_rand)) {
+				radiance += trace_shadow(shadow, world, local_rand);
+			}
+			if (!continue_path(r, rec, world, attenuation, scattered, pdf_val, cur_attenuation, cur_ray, prev)) {
+				break;
+			}
+		} else if (!connect_lights(r, rec, attenuation, world, cur_attenuation, cur_ray, local_rand)) {
+			break;
+		}
+		if (i + 1 < settings.max_depth && !survive_roulette(cur_attenuation, i + 1, settings, local_rand)) {
+			break;
+		}
+	}
+	return radiance; // exceeded recursion or ended by roulette
+}
+
+GPU inline color ray_color(const ray& r, const scene& world, const path_settings& settings, rng* local_rand) {
+	hit_record rec;
+	local_rand->start_slot(slot_medium);
+	bool hit = world.hit(r, 0.001f, FLT_MAX, rec, local_rand);
+	return trace_path(r, hit, rec, world, settings, local_rand);
+}
+
+#ifndef USE_CUDA
+
+/*
+ * ----------------------------------------------
+ * Wavefront integrator (host)
+ */
+
+/**
+ * \brief Path tracer that advances all paths of a batch one stage at a time instead of running each
+ * path to completion: generate camera rays, extend (trace) them, shade the hits, connect the
+ * scattering paths to the lights by picking their shadow and bounce rays, trace the shadow rays,
+ * repeat with the survivors. Between extend and shade the queue is
+ * sorted by material, so each shading block runs mostly one material; the shadow stage only gets the
+ * paths that sampled a light. Every stage, sorts included, runs in parallel blocks on the thread pool
+ * and is timed separately.
+ *
+ * Optionally the bounce rays are also binned before extend, by direction octant and then by the Morton
+ * code of their origin, so rays that traverse the same part of the BVH are traced by the same job.
+ *
+ * Paths are processed one sample at a time per pixel, each with the random stream of its sample, which
+ * keeps every pixel's random numbers and accumulation order identical to render_pixel.
+ * With adaptive sampling a pixel drops out once its noise target is met, as in render_pixel.
+ */
+class wavefront_integrator {
+public:
+	enum stage { generate_stage, ray_sort_stage, extend_stage, sort_stage, shade_stage, connect_stage, shadow_stage, num_stages };
+
+	wavefront_integrator(thread_pool& workers, int w, int h, const camera& c, const scene& s, const path_settings& path) :
+			pool(workers), width(w), height(h), cam(c), world(s), settings(path) {}
+
+	// One render pass: adds samples to every pixel of film until it has `samples` of them or converges
+	void render(pixel_accum* film, int samples);
+	void print_stage_times(std::ostream& out) const;
+
+public:
+	static constexpr int max_paths = 1 << 16;	///> pixels in flight, bounds the path state memory
+	static constexpr int block_size = 256;		///> paths per thread pool job
+	static constexpr int sort_block_size = 4096;	///> queue entries per job of a sort pass
+	static constexpr int radix_bits = 8;		///> key bits sorted per pass
+
+	bool sort_by_material = true;
+	bool sort_rays = false;						///> bin bounce rays by direction and origin before extend
+	bool packet_primary = true;					///> trace camera rays through hit_packet
+	double stage_ms[num_stages] = {};
+	uint64_t stage_items[num_stages] = {};
+
+private:
+	struct path_state {
+		ray primary;			///> camera ray of the path
+		ray cur;
+		color throughput;
+		color radiance;			///> gathered by this sample so far
+		path_vertex prev;
+		hit_record rec;
+		color attenuation;
+		ray scattered;			///> material sample from shade
+		float pdf_val;
+		light_sample light;
+		rng rand;				///> stream of this sample, advanced by every stage
+		int pixel;
+		int depth;
+		bool hit;
+		bool alive;
+		bool has_shadow;
+	};
+
+	void generate();
+	void sort_by_ray();
+	void extend(bool primary);
+	void sort_by_material_key();
+
+	// Sets sort_keys to key(path) of every queue entry in parallel; returns all keys or'ed together
+	template<class F>
+	uint64_t fill_sort_keys(F key);
+
+	// Stable sort of the queue by sort_keys, which have no bits outside key_mask, timed as stage s
+	void sort_queue(stage s, uint64_t key_mask);
+	void shade();
+	void connect();
+	void trace_shadows();
+	void retire();
+
+	// Runs f(begin, end) over the queue in blocks of block_size and adds the time to stage s
+	template<class F>
+	void run_stage(stage s, int count, F f);
+
+	thread_pool& pool;
+	int width, height;
+	camera cam;
+	scene world;
+	path_settings settings;
+
+	int first_pixel = 0;
+	int batch_pixels = 0;
+	pixel_accum* batch = nullptr;		///> film entries of the current batch
+	aabb scene_bounds;
+	std::vector<path_state> paths;
+	std::vector<int> active;			///> pixels of the current batch still taking samples
+	std::vector<int> queue;				///> live path indices
+	std::vector<int> shadow_queue;		///> paths of the queue with a light sample to trace
+	std::vector<uint64_t> sort_keys;	///> per queue entry
+	std::vector<uint64_t> sorted_keys;
+	std::vector<int> sorted_queue;
+	std::vector<uint64_t> block_key_bits;	///> per sort block, its keys or'ed together
+	std::vector<int> digit_offsets;		///> per sort block and digit, where its next entry goes
+};
+
+template<class F>
+inline void wavefront_integrator::run_stage(stage s, int count, F f) {
+	auto start = std::chrono::steady_clock::now();
+	int num_blocks = (count + block_size - 1) / block_size;
+	pool.parallel_for(num_blocks, [&](unsigned int b) {
+		f(b * block_size, std::min(count, int(b + 1) * block_size));
+	});
+	stage_ms[s] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	stage_items[s] += count;
+}
+
+inline void wavefront_integrator::render(pixel_accum* film, int samples) {
+	paths.resize(max_paths);
+	if (!world.bvh(world.top_level).bounding_box(0, 1, scene_bounds))
+		scene_bounds = aabb(point3(-1, -1, -1), point3(1, 1, 1));
+
+	for (first_pixel = 0; first_pixel < width * height; first_pixel += max_paths) {
+		batch_pixels = std::min(max_paths, width * height - first_pixel);
+		batch = film + first_pixel;
+		active.clear();
+		for (int p = 0; p < batch_pixels; p++) {
+			if (batch[p].wants_samples(samples, settings))
+				active.push_back(p);
+		}
+
+		while (!active.empty()) {
+			generate();
+			for (int depth = 0; !queue.empty(); depth++) {
+				if (depth > 0 && sort_rays)
+					sort_by_ray();
+				extend(depth == 0 && packet_primary);
+				if (sort_by_material)
+					sort_by_material_key();
+				shade();
+				connect();
+				trace_shadows();
+				retire();
+			}
+
+			// pixels that are done or meet the noise target take no further samples
+			size_t remaining = 0;
+			for (int p : active) {
+				if (batch[p].wants_samples(samples, settings))
+					active[remaining++] = p;
+			}
+			active.resize(remaining);
+		}
+	}
+}
+
+inline void wavefront_integrator::generate() {
+	// one path per active pixel, stored at the pixel's slot
+	queue.resize(active.size());
+	run_stage(generate_stage, int(active.size()), [&](int begin, int end) {
+		for (int a = begin; a < end; a++) {
+			int p = active[a];
+			int pixel = first_pixel + p;
+			int i = pixel % width;
+			int j = pixel / width;
+			path_state& path = paths[p];
+			path.rand = sample_rng(pixel, batch[p], settings);
+			float u = float(i + cu_random_float(&path.rand)) / float(width);
+			float v = float(j + cu_random_float(&path.rand)) / float(height);
+			path.primary = path.cur = cam.get_ray(u, v, &path.rand);
+			path.throughput = color(1, 1, 1);
+			path.radiance = color(0, 0, 0);
+			path.prev = path_vertex();
+			path.pixel = p;
+			path.depth = 0;
+			path.alive = true;
+			queue[a] = p;
+		}
+	});
+}
+
+inline void wavefront_integrator::extend(bool primary) {
+	run_stage(extend_stage, int(queue.size()), [&](int begin, int end) {
+		int i = begin;
+		if (primary) {
+			// camera rays of neighbouring pixels are coherent enough to share a packet traversal
+			for (; i + packet_width <= end; i += packet_width) {
+				ray rays[packet_width];
+				hit_record recs[packet_width];
+				rng* rands[packet_width];
+				for (int l = 0; l < packet_width; l++) {
+					path_state& path = paths[queue[i + l]];
+					rays[l] = path.cur;
+					rands[l] = &path.rand;
+					path.rand.start_slot(slot_medium);
+				}
+				packet_float t_max(FLT_MAX);
+				int hits = world.hit_packet(rays, packet_ray::gather(rays), (1 << packet_width) - 1, 0.001f, t_max, recs, rands);
+				for (int l = 0; l < packet_width; l++) {
+					path_state& path = paths[queue[i + l]];
+					path.hit = hits >> l & 1;
+					path.rec = recs[l];
+				}
+			}
+		}
+		for (; i < end; i++) {
+			path_state& path = paths[queue[i]];
+			path.rec = hit_record();
+			path.rand.start_slot(slot_medium);
+			path.hit = world.hit(path.cur, 0.001f, FLT_MAX, path.rec, &path.rand);
+		}
+	});
+}
+
+inline void wavefront_integrator::sort_by_ray() {
+	// octant in the top bits, so all rays of one octant share a traversal order; then a 10-bit per
+	// axis Morton code of the origin inside the scene bounds
+	auto start = std::chrono::steady_clock::now();
+	const float scale = 1023.0f;
+	vec3 extent = scene_bounds.max() - scene_bounds.min();
+	vec3 inv_extent(extent.x() > 0 ? 1 / extent.x() : 0, extent.y() > 0 ? 1 / extent.y() : 0, extent.z() > 0 ? 1 / extent.z() : 0);
+
+	uint64_t key_mask = fill_sort_keys([&](const path_state& path) {
+		const ray& r = path.cur;
+		vec3 d = r.direction();
+		uint64_t octant = (d.x() < 0) | (d.y() < 0) << 1 | (d.z() < 0) << 2;
+
+		vec3 p = (r.origin() - scene_bounds.min()) * inv_extent;
+		uint64_t x = static_cast<uint64_t>(fminf(fmaxf(p.x(), 0.0f), 1.0f) * scale);
+		uint64_t y = static_cast<uint64_t>(fminf(fmaxf(p.y(), 0.0f), 1.0f) * scale);
+		uint64_t z = static_cast<uint64_t>(fminf(fmaxf(p.z(), 0.0f), 1.0f) * scale);
+		return octant << 30 | expand_bits_10(x) << 2 | expand_bits_10(y) << 1 | expand_bits_10(z);
+	});
+	stage_ms[ray_sort_stage] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	sort_queue(ray_sort_stage, key_mask);
+}
+
+inline void wavefront_integrator::sort_by_material_key() {
+	// misses (key 0) first, then hits grouped by material index
+	auto start = std::chrono::steady_clock::now();
+	uint64_t key_mask = fill_sort_keys([](const path_state& path) {
+		return path.hit ? uint64_t(path.rec.material_id) + 1 : 0;
+	});
+	stage_ms[sort_stage] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	sort_queue(sort_stage, key_mask);
+}
+
+template<class F>
+inline uint64_t wavefront_integrator::fill_sort_keys(F key) {
+	int count = int(queue.size());
+	int num_blocks = (count + sort_block_size - 1) / sort_block_size;
+	sort_keys.resize(count);
+	block_key_bits.assign(num_blocks, 0);
+	pool.parallel_for(num_blocks, [&](unsigned int b) {
+		uint64_t bits = 0;
+		for (int i = b * sort_block_size; i < std::min(count, int(b + 1) * sort_block_size); i++) {
+			sort_keys[i] = key(paths[queue[i]]);
+			bits |= sort_keys[i];
+		}
+		block_key_bits[b] = bits;
+	});
+
+	uint64_t key_mask = 0;
+	for (uint64_t bits : block_key_bits)
+		key_mask |= bits;
+	return key_mask;
+}
+
+inline void wavefront_integrator::sort_queue(stage s, uint64_t key_mask) {
+	// LSD radix sort, one pass per radix_bits digit up to the highest key bit. A pass counts the digits of
+	// every block in parallel, turns the counts into start offsets in (digit, block) order, then scatters
+	// every block in parallel in its own order, so ties keep queue order as in a stable sort. The order only
+	// affects speed, every path keeps its own random stream.
+	auto start = std::chrono::steady_clock::now();
+	const int num_digits = 1 << radix_bits;
+	int count = int(queue.size());
+	int num_blocks = (count + sort_block_size - 1) / sort_block_size;
+	sorted_queue.resize(count);
+	sorted_keys.resize(count);
+	digit_offsets.resize(size_t(num_blocks) * num_digits);
+
+	for (int shift = 0; shift < 64 && (key_mask >> shift) != 0; shift += radix_bits) {
+		pool.parallel_for(num_blocks, [&](unsigned int b) {
+			int* counts = &digit_offsets[size_t(b) * num_digits];
+			std::fill(counts, counts + num_digits, 0);
+			for (int i = b * sort_block_size; i < std::min(count, int(b + 1) * sort_block_size); i++)
+				counts[(sort_keys[i] >> shift) & (num_digits - 1)]++;
+		});
+
+		int offset = 0;
+		for (int d = 0; d < num_digits; d++) {
+			for (int b = 0; b < num_blocks; b++) {
+				int& slot = digit_offsets[size_t(b) * num_digits + d];
+				int n = slot;
+				slot = offset;
+				offset += n;
+			}
+		}
+
+		pool.parallel_for(num_blocks, [&](unsigned int b) {
+			int* next = &digit_offsets[size_t(b) * num_digits];
+			for (int i = b * sort_block_size; i < std::min(count, int(b + 1) * sort_block_size); i++) {
+				int dst = next[(sort_keys[i] >> shift) & (num_digits - 1)]++;
+				sorted_queue[dst] = queue[i];
+				sorted_keys[dst] = sort_keys[i];
+			}
+		});
+		queue.swap(sorted_queue);
+		sort_keys.swap(sorted_keys);
+	}
+
+	stage_ms[s] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	stage_items[s] += queue.size();
+}
+
+inline void wavefront_integrator::shade() {
+	run_stage(shade_stage, int(queue.size()), [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			path_state& path = paths[queue[i]];
+			path.has_shadow = false;
+			if (!path.hit) {
+				path.radiance += path.throughput * background(path.cur, settings.sky);
+				path.alive = false;
+				continue;
+			}
+
+			color emitted;
+			path.rand.start_bounce(path.depth + 1);
+			if (!shade_hit(path.primary, path.cur, path.rec, world, path.attenuation, emitted, path.scattered, path.pdf_val, &path.rand)) {
+				path.radiance += path.throughput * emitted * emission_weight(path.prev, path.cur, world);
+				path.alive = false;
+			}
+		}
+	});
+}
+
+inline void wavefront_integrator::connect() {
+	run_stage(connect_stage, int(queue.size()), [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			path_state& path = paths[queue[i]];
+			if (!path.alive)
+				continue;
+
+			rng* local_rand = &path.rand;
+			if (settings.next_event) {
+				path.has_shadow = sample_light(path.primary, path.rec, path.attenuation, path.throughput, world, path.light, local_rand);
+				if (!continue_path(path.primary, path.rec, world, path.attenuation, path.scattered, path.pdf_val, path.throughput, path.cur, path.prev)) {
+					path.alive = false;
+					continue;
+				}
+			} else if (!connect_lights(path.primary, path.rec, path.attenuation, world, path.throughput, path.cur, local_rand)) {
+				path.alive = false;
+				continue;
+			}
+
+			if (++path.depth == settings.max_depth) {
+				// exceeded recursion, keeps what it gathered
+				path.alive = false;
+			} else if (!survive_roulette(path.throughput, path.depth, settings, local_rand)) {
+				path.alive = false;
+			}
+		}
+	});
+}
+
+inline void wavefront_integrator::trace_shadows() {
+	if (!settings.next_event)
+		return;
+
+	// only the paths holding a light sample are queued, so every block traces shadow rays alone; paths
+	// ended by roulette in connect still add theirs, as in trace_path
+	auto start = std::chrono::steady_clock::now();
+	shadow_queue.clear();
+	for (int p : queue) {
+		if (paths[p].has_shadow)
+			shadow_queue.push_back(p);
+	}
+	stage_ms[shadow_stage] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	run_stage(shadow_stage, int(shadow_queue.size()), [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			path_state& path = paths[shadow_queue[i]];
+			path.radiance += trace_shadow(path.light, world, &path.rand);
+		}
+	});
+}
+
+inline void wavefront_integrator::retire() {
+	// finished paths hand their sample to the pixel; only one path per pixel is in flight
+	size_t live = 0;
+	for (size_t i = 0; i < queue.size(); i++) {
+		path_state& path = paths[queue[i]];
+		if (path.alive) {
+			queue[live++] = queue[i];
+		} else {
+			batch[path.pixel].sum += path.radiance;
+			batch[path.pixel].stats.add(path.radiance);
+		}
+	}
+	queue.resize(live);
+}
+
+inline void wavefront_integrator::print_stage_times(std::ostream& out) const {
+	const char* names[num_stages] = { "generate", "ray sort", "extend", "material sort", "shade", "connect", "shadow" };
+	double total = 0;
+	for (int s = 0; s < num_stages; s++)
+		total += stage_ms[s];
+
+	out << "Wavefront stages:" << std::endl;
+	for (int s = 0; s < num_stages; s++) {
+		if (stage_items[s] == 0)
+			continue;
+		out << "  " << names[s] << ": " << stage_ms[s] << " ms (" << 100.0 * stage_ms[s] / total << "%), "
+			<< stage_items[s] << " paths, " << (stage_ms[s] > 0 ? stage_items[s] / stage_ms[s] / 1e3 : 0.0) << " Mpaths/s" << std::endl;
+	}
+}
+
+#endif // USE_CUDA
@@ -0,0 +1,510 @@
+#pragma once
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * \brief Linear BVH builder (Karras 2012): sorts primitives along a Morton curve over their centroids
+ * with a parallel radix sort, builds the binary radix tree over the sorted codes with every internal
+ * node computed independently, and fits bounds bottom-up. Much faster than the top-down SAH build,
+ * meant for rebuilding animated scenes every frame. Optional treelet restructuring (Karras & Aila 2013)
+ * recovers most of the SAH quality. Emits the same flat node layout as bvh_builder.
+ */
+class lbvh_builder : public bvh_build_result {
+public:
+	lbvh_builder(const std::vector<aabb>& prim_boxes, int leaf_size = 4, int code_bits = 30, int restructure_passes = 0) :
+			boxes(prim_boxes),
+			max_leaf_size(std::max(1, std::min(leaf_size, 0xffff))),
+			morton_bits(code_bits > 30 ? 63 : 30),
+			treelet_passes(std::max(0, restructure_passes)) {}
+
+	void build(thread_pool* pool = nullptr);
+
+public:
+	static constexpr int treelet_size = 7;		///> leaves per treelet, the optimal split search is 3^n
+	static constexpr int chunk_size = 16384;	///> primitives per parallel job
+
+private:
+	void compute_codes(thread_pool* pool);
+	void radix_sort(thread_pool* pool);
+	void build_radix_tree(thread_pool* pool);
+	void fit_bounds(thread_pool* pool, int min_treelet_prims);
+	void restructure_treelet(int root);
+	void update_node(int node);
+	void flatten();
+
+	int delta(int i, int j) const;
+
+	template<class F>
+	void parallel_chunks(thread_pool* pool, int count, F f);
+
+	const std::vector<aabb>& boxes;
+	int max_leaf_size;
+	int morton_bits;
+	int treelet_passes;
+
+	int n = 0;
+	std::vector<uint64_t> codes;
+	std::vector<int> sorted;
+
+	// binary radix tree: internal nodes 0 .. n-2, leaf for sorted primitive i at n - 1 + i
+	std::vector<int> left, right, parent;
+	std::vector<aabb> bounds;
+	std::vector<float> cost;
+	std::vector<int> prim_count;
+	std::vector<std::atomic<int>> visits;
+};
+
+inline uint64_t count_leading_zeros(uint64_t x) {
+	if (x == 0)
+		return 64;
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - index;
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+// Spreads the low 10 bits of x so there are two zero bits between each
+inline uint64_t expand_bits_10(uint64_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// Spreads the low 21 bits of x so there are two zero bits between each
+inline uint64_t expand_bits_21(uint64_t x) {
+	x &= 0x1fffff;
+	x = (x | (x << 32)) & 0x1f00000000ffffULL;
+	x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+	x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+	x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+	x = (x | (x << 2)) & 0x1249249249249249ULL;
+	return x;
+}
+
+inline int count_bits(unsigned int x) {
+	int c = 0;
+	for (; x; x &= x - 1)
+		c++;
+	return c;
+}
+
+template <class F>
+inline void lbvh_builder::parallel_chunks(thread_pool* pool, int count, F f) {
+	int num_chunks = (count + chunk_size - 1) / chunk_size;
+	auto run_chunk = [&](unsigned int c) {
+		f(static_cast<int>(c) * chunk_size, std::min(count, static_cast<int>(c + 1) * chunk_size));
+	};
+
+	if (!pool || num_chunks <= 1) {
+		for (int c = 0; c < num_chunks; c++)
+			run_chunk(c);
+	} else {
+		pool->parallel_for(num_chunks, run_chunk);
+	}
+}
+
+inline void lbvh_builder::build(thread_pool* pool) {
+	auto start = std::chrono::steady_clock::now();
+	nodes.clear();
+	indices.clear();
+	max_depth = 0;
+	num_leaves = 0;
+	build_threads = pool ? pool->num_threads() : 1;
+	n = static_cast<int>(boxes.size());
+
+	if (n == 0) {
+		linear_bvh_node leaf{};
+		leaf.bounds = aabb::empty();
+		nodes.push_back(leaf);
+		num_leaves = 1;
+	} else {
+		compute_codes(pool);
+		radix_sort(pool);
+		build_radix_tree(pool);
+		fit_bounds(pool, 0);
+		// only subtrees big enough to end up as several leaves are worth restructuring, and every pass
+		// after the first concentrates on the upper levels where the Morton order is poorest
+		for (int pass = 0; pass < treelet_passes; pass++)
+			fit_bounds(pool, (treelet_size * max_leaf_size) << pass);
+		flatten();
+	}
+
+	codes = std::vector<uint64_t>();
+	sorted = std::vector<int>();
+	left = right = parent = prim_count = std::vector<int>();
+	bounds = std::vector<aabb>();
+	cost = std::vector<float>();
+	visits = std::vector<std::atomic<int>>();
+	build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void lbvh_builder::compute_codes(thread_pool* pool) {
+	aabb centroids = aabb::empty();
+	for (const aabb& box : boxes)
+		centroids = surrounding_box(centroids, box.centroid());
+
+	const int bits_per_axis = morton_bits / 3;
+	const float scale = static_cast<float>((1u << bits_per_axis) - 1);
+	vec3 extent = centroids.max() - centroids.min();
+	vec3 inv_extent(extent.x() > 0 ? 1 / extent.x() : 0, extent.y() > 0 ? 1 / extent.y() : 0, extent.z() > 0 ? 1 / extent.z() : 0);
+
+	codes.resize(n);
+	sorted.resize(n);
+	parallel_chunks(pool, n, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			vec3 p = (boxes[i].centroid() - centroids.min()) * inv_extent;
+			uint64_t x = static_cast<uint64_t>(p.x() * scale);
+			uint64_t y = static_cast<uint64_t>(p.y() * scale);
+			uint64_t z = static_cast<uint64_t>(p.z() * scale);
+			codes[i] = morton_bits == 30
+					? (expand_bits_10(x) << 2) | (expand_bits_10(y) << 1) | expand_bits_10(z)
+					: (expand_bits_21(x) << 2) | (expand_bits_21(y) << 1) | expand_bits_21(z);
+			sorted[i] = i;
+		}
+	});
+}
+
+inline void lbvh_builder::radix_sort(thread_pool* pool) {
+	// LSD radix sort on 8-bit digits; chunks histogram and scatter in parallel, and since each chunk
+	// scatters in order the sort stays stable, so equal codes keep primitive order
+	const int radix = 256;
+	int num_chunks = (n + chunk_size - 1) / chunk_size;
+	std::vector<uint64_t> codes_tmp(n);
+	std::vector<int> sorted_tmp(n);
+	std::vector<int> offsets(num_chunks * radix);
+
+	for (int shift = 0; shift < morton_bits; shift += 8) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+		parallel_chunks(pool, n, [&](int begin, int end) {
+			int* histogram = &offsets[(begin / chunk_size) * radix];
+			for (int i = begin; i < end; i++)
+				histogram[(codes[i] >> shift) & 0xff]++;
+		});
+
+		int sum = 0;
+		for (int digit = 0; digit < radix; digit++) {
+			for (int c = 0; c < num_chunks; c++) {
+				int count = offsets[c * radix + digit];
+				offsets[c * radix + digit] = sum;
+				sum += count;
+			}
+		}
+
+		parallel_chunks(pool, n, [&](int begin, int end) {
+			int* offset = &offsets[(begin / chunk_size) * radix];
+			for (int i = begin; i < end; i++) {
+				int dst = offset[(codes[i] >> shift) & 0xff]++;
+				codes_tmp[dst] = codes[i];
+				sorted_tmp[dst] = sorted[i];
+			}
+		});
+		codes.swap(codes_tmp);
+		sorted.swap(sorted_tmp);
+	}
+}
+
+// Length of the common prefix of sorted codes i and j, -1 when j is out of range; duplicate codes are
+// told apart by their position so every internal node still has a unique split
+inline int lbvh_builder::delta(int i, int j) const {
+	if (j < 0 || j >= n)
+		return -1;
+	uint64_t a = codes[i], b = codes[j];
+	if (a == b)
+		return 64 + static_cast<int>(count_leading_zeros(static_cast<uint64_t>(i ^ j)) - 32);
+	return static_cast<int>(count_leading_zeros(a ^ b));
+}
+
+inline void lbvh_builder::build_radix_tree(thread_pool* pool) {
+	int total = 2 * n - 1;
+	left.assign(std::max(n - 1, 0), -1);
+	right.assign(std::max(n - 1, 0), -1);
+	parent.assign(total, -1);
+
+	parallel_chunks(pool, n - 1, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			// the node covers a range that starts or ends at i, going in the direction of the longer prefix
+			int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+			int delta_min = delta(i, i - d);
+
+			int length_max = 2;
+			while (delta(i, i + length_max * d) > delta_min)
+				length_max *= 2;
+
+			int length = 0;
+			for (int t = length_max / 2; t >= 1; t /= 2) {
+				if (delta(i, i + (length + t) * d) > delta_min)
+					length += t;
+			}
+			int j = i + length * d;
+
+			// binary search for the last position sharing more than the node's own prefix
+			int delta_node = delta(i, j);
+			int split = 0;
+			for (int t = (length + 1) / 2;; t = (t + 1) / 2) {
+				if (delta(i, i + (split + t) * d) > delta_node)
+					split += t;
+				if (t == 1)
+					break;
+			}
+			int gamma = i + split * d + std::min(d, 0);
+
+			int first = std::min(i, j), last = std::max(i, j);
+			left[i] = first == gamma ? n - 1 + gamma : gamma;
+			right[i] = last == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+			parent[left[i]] = i;
+			parent[right[i]] = i;
+		}
+	});
+}
+
+inline void lbvh_builder::update_node(int node) {
+	int l = left[node], r = right[node];
+	bounds[node] = surrounding_box(bounds[l], bounds[r]);
+	prim_count[node] = prim_count[l] + prim_count[r];
+
+	// a subtree within the leaf size is collapsed into one leaf when flattened, if that is cheaper
+	float area = bounds[node].surface_area();
+	float split_cost = traversal_cost * area + cost[l] + cost[r];
+	float leaf_cost = intersection_cost * area * prim_count[node];
+	cost[node] = prim_count[node] <= max_leaf_size ? std::min(split_cost, leaf_cost) : split_cost;
+}
+
+// Refits bounds and costs bottom-up, restructuring treelets rooted at subtrees with at least
+// min_treelet_prims primitives (none when 0)
+inline void lbvh_builder::fit_bounds(thread_pool* pool, int min_treelet_prims) {
+	int total = 2 * n - 1;
+	bool restructure = min_treelet_prims > 0;
+	if (!restructure) {
+		bounds.resize(total);
+		cost.resize(total);
+		prim_count.resize(total);
+		visits = std::vector<std::atomic<int>>(std::max(n - 1, 1));
+	}
+	for (int i = 0; i < n - 1; i++)
+		visits[i].store(0);
+
+	// one walk up from every leaf; the second child to arrive at a node finishes it and carries on,
+	// so every node is processed exactly once, after both of its subtrees
+	parallel_chunks(pool, n, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			int leaf = n - 1 + i;
+			bounds[leaf] = boxes[sorted[i]];
+			prim_count[leaf] = 1;
+			cost[leaf] = intersection_cost * bounds[leaf].surface_area();
+
+			int node = parent[leaf];
+			while (node >= 0) {
+				if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+					break;
+				if (restructure && prim_count[left[node]] + prim_count[right[node]] >= min_treelet_prims)
+					restructure_treelet(node);
+				update_node(node);
+				node = parent[node];
+			}
+		}
+	});
+}
+
+/**
+ * \brief Rearranges the treelet of up to treelet_size subtrees below root into the topology with
+ * the lowest SAH cost, found by dynamic programming over all subsets of those subtrees.
+ * Only touches nodes inside root's subtree, which no other walker can reach at this point.
+ */
+inline void lbvh_builder::restructure_treelet(int root) {
+	const int num_subsets = 1 << treelet_size;
+	int treelet_leaves[treelet_size];
+	int treelet_internal[treelet_size - 1];
+	int num_leaves_t = 2, num_internal = 1;
+	treelet_leaves[0] = left[root];
+	treelet_leaves[1] = right[root];
+	treelet_internal[0] = root;
+
+	// grow the treelet by repeatedly opening up the internal leaf with the largest area
+	while (num_leaves_t < treelet_size) {
+		int best = -1;
+		float best_area = -1.0f;
+		for (int k = 0; k < num_leaves_t; k++) {
+			int node = treelet_leaves[k];
+			if (node < n - 1 && bounds[node].surface_area() > best_area) {
+				best = k;
+				best_area = bounds[node].surface_area();
+			}
+		}
+		if (best < 0)
+			break;
+
+		int node = treelet_leaves[best];
+		treelet_internal[num_internal++] = node;
+		treelet_leaves[best] = left[node];
+		treelet_leaves[num_leaves_t++] = right[node];
+	}
+
+	float area[num_subsets];
+	float best_cost[num_subsets];
+	int best_partition[num_subsets];
+	int count[num_subsets];
+	int full = (1 << num_leaves_t) - 1;
+
+	for (int mask = 1; mask <= full; mask++) {
+		aabb box = aabb::empty();
+		int c = 0;
+		for (int k = 0; k < num_leaves_t; k++) {
+			if (mask & (1 << k)) {
+				box = surrounding_box(box, bounds[treelet_leaves[k]]);
+				c += prim_count[treelet_leaves[k]];
+			}
+		}
+		area[mask] = box.surface_area();
+		count[mask] = c;
+	}
+
+	for (int k = 0; k < num_leaves_t; k++)
+		best_cost[1 << k] = cost[treelet_leaves[k]];
+
+	// subsets in increasing size, so both halves of every partition are already solved
+	for (int size = 2; size <= num_leaves_t; size++) {
+		for (int mask = 1; mask <= full; mask++) {
+			if (count_bits(mask) != size)
+				continue;
+
+			float best = infinity;
+			int best_p = 0;
+			int low = mask & -mask;
+			// enumerate partitions with the lowest leaf always on the left, halving the search
+			for (int p = (mask - 1) & mask; p > 0; p = (p - 1) & mask) {
+				if (!(p & low))
+					continue;
+				float c = best_cost[p] + best_cost[mask ^ p];
+				if (c < best) {
+					best = c;
+					best_p = p;
+				}
+			}
+
+			float split_cost = traversal_cost * area[mask] + best;
+			float leaf_cost = intersection_cost * area[mask] * count[mask];
+			best_cost[mask] = count[mask] <= max_leaf_size ? std::min(split_cost, leaf_cost) : split_cost;
+			best_partition[mask] = best_p;
+		}
+	}
+
+	if (!(best_cost[full] < cost[root]))
+		return;
+
+	// rebuild the treelet top-down from the stored partitions, reusing its internal nodes
+	struct item {
+		int node;
+		int mask;
+	};
+	item stack[treelet_size];
+	int stack_size = 0;
+	int next_internal = 1;
+	int post_order[treelet_size - 1];
+	int num_post = 0;
+	stack[stack_size++] = { root, full };
+
+	while (stack_size > 0) {
+		item it = stack[--stack_size];
+		post_order[num_post++] = it.node;
+		int masks[2] = { best_partition[it.mask], it.mask ^ best_partition[it.mask] };
+		int children[2];
+		for (int c = 0; c < 2; c++) {
+			if (count_bits(masks[c]) == 1) {
+				int k = 0;
+				while (!(masks[c] & (1 << k)))
+					k++;
+				children[c] = treelet_leaves[k];
+			} else {
+				children[c] = treelet_internal[next_internal++];
+				stack[stack_size++] = { children[c], masks[c] };
+			}
+			parent[children[c]] = it.node;
+		}
+		left[it.node] = children[0];
+		right[it.node] = children[1];
+	}
+
+	// children were pushed after their parents, so refit in reverse
+	for (int k = num_post - 1; k > 0; k--)
+		update_node(post_order[k]);
+}
+
+inline void lbvh_builder::flatten() {
+	// depth-first walk of the radix tree; subtrees that update_node chose to collapse become leaves
+	// and their primitives are emitted in walk order, so leaf ranges stay contiguous after restructuring
+	nodes.reserve(2 * n);
+	indices.reserve(n);
+
+	struct item {
+		int node;
+		int parent_flat;	///> flat index of the parent, or -1, for second children to patch their offset
+		int depth;
+	};
+	std::vector<item> stack;
+	std::vector<int> gather;
+	stack.push_back({ 0, -1, 0 });	// internal node 0, or the only leaf when n == 1
+
+	while (!stack.empty()) {
+		item it = stack.back();
+		stack.pop_back();
+		int node = it.node;
+		int flat = static_cast<int>(nodes.size());
+		if (it.parent_flat >= 0)
+			nodes[it.parent_flat].offset = flat;
+		max_depth = std::max(max_depth, it.depth);
+
+		linear_bvh_node out{};
+		out.bounds = bounds[node];
+		bool is_leaf = node >= n - 1;
+		bool collapse = !is_leaf && prim_count[node] <= max_leaf_size &&
+				intersection_cost * bounds[node].surface_area() * prim_count[node] <= cost[node];
+		// keep within the traversal stack, Morton trees over clustered primitives can get deep
+		collapse = collapse || (!is_leaf && it.depth >= bvh_max_depth - 1 && prim_count[node] <= 0xffff);
+
+		if (is_leaf || collapse) {
+			out.offset = static_cast<int>(indices.size());
+			out.num_prims = static_cast<uint16_t>(prim_count[node]);
+			gather.assign(1, node);
+			while (!gather.empty()) {
+				int g = gather.back();
+				gather.pop_back();
+				if (g >= n - 1) {
+					indices.push_back(sorted[g - (n - 1)]);
+				} else {
+					gather.push_back(right[g]);
+					gather.push_back(left[g]);
+				}
+			}
+			nodes.push_back(out);
+			num_leaves++;
+			continue;
+		}
+
+		// split axis is where the children's centers are furthest apart, the lower child goes first
+		vec3 d = bounds[right[node]].centroid() - bounds[left[node]].centroid();
+		int axis = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+		bool swap_children = d[axis] < 0.0f;
+		out.axis = static_cast<uint8_t>(axis);
+		nodes.push_back(out);
+
+		stack.push_back({ swap_children ? left[node] : right[node], flat, it.depth + 1 });
+		stack.push_back({ swap_children ? right[node] : left[node], -1, it.depth + 1 });
+	}
+}
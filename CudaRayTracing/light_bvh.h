@@ -0,0 +1,268 @@
+#pragma once
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * \brief Conservative bounds of a group of emitters: where they are, which way they emit and how much.
+ * The normals of all emitters lie within theta_o of axis, and each emits up to theta_e past its normal
+ * (pi/2 for diffuse surfaces); omnidirectional emitters such as spheres have theta_o = pi.
+ */
+struct light_bounds {
+	aabb bounds;
+	vec3 axis;
+	float theta_o;
+	float theta_e;
+	float power;
+
+	// Estimated contribution to a point at p, up to a constant factor; 0 if the cone cannot reach p
+	XPU float importance(const point3& p) const;
+};
+
+XPU inline float light_bounds::importance(const point3& p) const {
+	if (power <= 0)
+		return 0;
+
+	// distance clamped to the bounding sphere, so points inside or near the bounds do not blow up
+	point3 center = bounds.centroid();
+	float radius2 = 0.25f * (bounds.max() - bounds.min()).length_squared();
+	float d2 = fmaxf((p - center).length_squared(), radius2);
+
+	// angle between the axis and p, less the spread of the normals and of the bounds seen from p
+	float cos_w = dot(axis, unit_vector(p - center));
+	float theta_w = acosf(fminf(fmaxf(cos_w, -1.0f), 1.0f));
+	float theta_b = d2 > radius2 ? asinf(sqrtf(radius2 / d2)) : pi;
+	float theta = fmaxf(theta_w - theta_o - theta_b, 0.0f);
+	if (theta >= theta_e)
+		return 0;
+	return power * cosf(theta) / d2;
+}
+
+/**
+ * \brief Node of a light_bvh, laid out depth-first like linear_bvh_node: the first child follows its
+ * parent, the second is at offset. Leaves hold one light, whose index is in offset.
+ */
+struct light_bvh_node {
+	light_bounds light;
+	int offset;
+	int is_leaf;
+};
+
+/**
+ * \brief Light hierarchy over many emitters: random() walks down from the root choosing each child in
+ * proportion to its importance for the shading point, so distant or facing-away groups are rarely
+ * picked. pdf_value() follows only the branches whose bounds the direction passes through.
+ * The lights are primitive indices, evaluated through the functions the scene passes in, as in light_list.
+ * Does not own the lights or the nodes, which are built on the host by light_bvh_builder.
+ */
+class light_bvh {
+public:
+	XPU light_bvh(const int* light_ids, int n, const light_bvh_node* bvh_nodes) :
+			lights(light_ids), count(n), nodes(bvh_nodes) {}
+
+	template<class F>
+	GPU float pdf_value(const point3& o, const vec3& v, F light_pdf) const;
+
+	// Returns the zero vector when no light can reach o; callers check for it before normalizing
+	template<class F>
+	GPU vec3 random(const vec3& o, rng* local_rand, F light_random) const {
+		float pmf;
+		int i = select(o, 1.0f - cu_random_float(local_rand), pmf);
+		if (i < 0)
+			return vec3(0, 0, 0);
+		local_rand->start_slot(slot_light_sample);
+		return light_random(lights[i], o, local_rand);
+	}
+
+	// Picks a light for the shading point p with u in [0, 1); returns its index and probability in pmf,
+	// or -1 if no light can reach p
+	XPU int select(const point3& p, float u, float& pmf) const;
+
+public:
+	const int* lights;
+	int count;
+	const light_bvh_node* nodes;
+};
+
+XPU inline int light_bvh::select(const point3& p, float u, float& pmf) const {
+	const float one_minus_epsilon = 0x1.fffffep-1f;
+	int current = 0;
+	pmf = 1;
+	while (!nodes[current].is_leaf) {
+		float i0 = nodes[current + 1].light.importance(p);
+		float i1 = nodes[nodes[current].offset].light.importance(p);
+		if (!(i0 + i1 > 0))
+			return -1;
+
+		// u is reused for the next level by rescaling the part of [0, 1) it fell into
+		float p0 = i0 / (i0 + i1);
+		if (u < p0) {
+			u = fminf(u / p0, one_minus_epsilon);
+			pmf *= p0;
+			current = current + 1;
+		} else {
+			u = fminf((u - p0) / (1 - p0), one_minus_epsilon);
+			pmf *= 1 - p0;
+			current = nodes[current].offset;
+		}
+	}
+	return nodes[current].offset;
+}
+
+template<class F>
+GPU inline float light_bvh::pdf_value(const point3& o, const vec3& v, F light_pdf) const {
+	ray r(o, v);
+	vec3 inv_dir(1.0f / v.x(), 1.0f / v.y(), 1.0f / v.z());
+	int dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	// only lights the direction can reach contribute, each weighted by the probability of selecting it
+	int stack[bvh_max_depth];
+	float stack_pmf[bvh_max_depth];
+	int stack_size = 0;
+	float sum = 0;
+	if (nodes[0].light.bounds.hit(r, inv_dir, dir_is_neg, 0.001f, FLT_MAX)) {
+		stack[0] = 0;
+		stack_pmf[0] = 1;
+		stack_size = 1;
+	}
+
+	while (stack_size > 0) {
+		stack_size--;
+		const light_bvh_node& node = nodes[stack[stack_size]];
+		float pmf = stack_pmf[stack_size];
+		if (node.is_leaf) {
+			sum += pmf * light_pdf(lights[node.offset], o, v);
+			continue;
+		}
+
+		int children[2] = { stack[stack_size] + 1, node.offset };
+		float i0 = nodes[children[0]].light.importance(o);
+		float i1 = nodes[children[1]].light.importance(o);
+		if (!(i0 + i1 > 0))
+			continue;
+		float child_pmf[2] = { i0 / (i0 + i1), i1 / (i0 + i1) };
+		for (int c = 0; c < 2; c++) {
+			if (child_pmf[c] > 0 && nodes[children[c]].light.bounds.hit(r, inv_dir, dir_is_neg, 0.001f, FLT_MAX)) {
+				stack[stack_size] = children[c];
+				stack_pmf[stack_size] = pmf * child_pmf[c];
+				stack_size++;
+			}
+		}
+	}
+	return sum;
+}
+
+/*
+ * ----------------------------------------------
+ * Host-side construction
+ */
+
+// Bounds of a diffuse sphere light
+inline light_bounds sphere_light_bounds(const point3& center, float radius, float power) {
+	vec3 r(radius, radius, radius);
+	return { aabb(center - r, center + r), vec3(0, 1, 0), pi, pi / 2, power };
+}
+
+// Bounds of a one-sided diffuse rect light emitting along normal
+inline light_bounds rect_light_bounds(const aabb& box, const vec3& normal, float power) {
+	return { box, normal, 0.0f, pi / 2, power };
+}
+
+/**
+ * \brief Collects light bounds on the host and builds the flat light_bvh nodes over them
+ */
+class light_bvh_builder {
+public:
+	// Adds light i of the light_bvh's light array; lights are expected in index order
+	void add(const light_bounds& bounds) { lights.push_back(bounds); }
+
+	void build();
+
+public:
+	std::vector<light_bounds> lights;
+	std::vector<light_bvh_node> nodes;
+
+private:
+	int build_recursive(std::vector<int>& order, int begin, int end);
+};
+
+// Smallest cone found cheaply that holds both cones
+inline void merge_cones(const light_bounds& a, const light_bounds& b, vec3& axis, float& theta_o) {
+	if (b.theta_o > a.theta_o) {
+		merge_cones(b, a, axis, theta_o);
+		return;
+	}
+
+	axis = a.axis;
+	theta_o = a.theta_o;
+	float theta_d = acosf(fminf(fmaxf(dot(a.axis, b.axis), -1.0f), 1.0f));
+	if (fminf(theta_d + b.theta_o, pi) <= a.theta_o)
+		return;
+
+	// rotate a's axis toward b's so the new cone just reaches both far edges
+	float theta = 0.5f * (a.theta_o + theta_d + b.theta_o);
+	vec3 w = cross(a.axis, b.axis);
+	if (theta >= pi || w.length_squared() == 0) {
+		theta_o = pi;
+		return;
+	}
+	float theta_r = theta - a.theta_o;
+	w = unit_vector(w);
+	axis = cos(theta_r) * a.axis + sin(theta_r) * cross(w, a.axis);
+	theta_o = theta;
+}
+
+inline light_bounds merge(const light_bounds& a, const light_bounds& b) {
+	if (a.power <= 0)
+		return b;
+	if (b.power <= 0)
+		return a;
+
+	light_bounds m;
+	m.bounds = surrounding_box(a.bounds, b.bounds);
+	merge_cones(a, b, m.axis, m.theta_o);
+	m.theta_e = fmaxf(a.theta_e, b.theta_e);
+	m.power = a.power + b.power;
+	return m;
+}
+
+inline void light_bvh_builder::build() {
+	nodes.clear();
+	if (lights.empty())
+		return;
+	std::vector<int> order(lights.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = static_cast<int>(i);
+	nodes.reserve(2 * lights.size() - 1);
+	build_recursive(order, 0, static_cast<int>(order.size()));
+}
+
+inline int light_bvh_builder::build_recursive(std::vector<int>& order, int begin, int end) {
+	int index = static_cast<int>(nodes.size());
+	nodes.push_back({});
+	if (end - begin == 1) {
+		nodes[index] = { lights[order[begin]], order[begin], 1 };
+		return index;
+	}
+
+	// median split along the widest spread of centers keeps the tree balanced, well under bvh_max_depth
+	aabb centroids = aabb::empty();
+	for (int i = begin; i < end; i++)
+		centroids = surrounding_box(centroids, lights[order[i]].bounds.centroid());
+	vec3 extent = centroids.max() - centroids.min();
+	int axis = extent.x() > extent.y() && extent.x() > extent.z() ? 0 : (extent.y() > extent.z() ? 1 : 2);
+
+	int mid = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+		return lights[a].bounds.centroid()[axis] < lights[b].bounds.centroid()[axis];
+	});
+
+	build_recursive(order, begin, mid);
+	int second = build_recursive(order, mid, end);
+	light_bounds bounds = merge(nodes[index + 1].light, nodes[second].light);
+	nodes[index] = { bounds, second, 0 };
+	return index;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "hittable.h"
+
+#include <vector>
+
+/**
+ * \brief Set of emitters sampled as one light: random() first picks a light in proportion to its power
+ * through an alias table, then a direction toward it; pdf_value() is the matching mixture density.
+ * The lights are primitive indices, evaluated through the functions the scene passes in.
+ * Does not own the lights or the table arrays, which are built on the host by alias_table.
+ */
+class light_list {
+public:
+	XPU light_list(const int* light_ids, int n, const float* pdf, const float* prob, const int* alias_idx) :
+			lights(light_ids), count(n), select_pdf(pdf), alias_prob(prob), alias(alias_idx) {}
+
+	// light_pdf(int light, const point3& o, const vec3& v) is the density of one light
+	template<class F>
+	GPU float pdf_value(const point3& o, const vec3& v, F light_pdf) const {
+		// every light can produce the direction, e.g. through one in front of the other
+		float sum = 0;
+		for (int i = 0; i < count; i++)
+			sum += select_pdf[i] * light_pdf(lights[i], o, v);
+		return sum;
+	}
+
+	// light_random(int light, const point3& o, rng*) samples a direction toward one light
+	template<class F>
+	GPU vec3 random(const vec3& o, rng* local_rand, F light_random) const {
+		int i = select(cu_random_float(local_rand));
+		local_rand->start_slot(slot_light_sample);
+		return light_random(lights[i], o, local_rand);
+	}
+
+	// Maps u in [0, 1) to a light index with probability select_pdf[i]
+	XPU int select(float u) const {
+		float x = u * count;
+		int i = x < count - 1 ? int(x) : count - 1;
+		return x - i < alias_prob[i] ? i : alias[i];
+	}
+
+public:
+	const int* lights;
+	int count;
+	const float* select_pdf;	///> power of each light over the total
+	const float* alias_prob;	///> chance that slot i keeps light i rather than alias[i]
+	const int* alias;
+};
+
+/*
+ * ----------------------------------------------
+ * Host-side construction
+ */
+
+/**
+ * \brief Alias table for picking index i with probability weights[i] / sum in O(1) (Vose's method)
+ */
+class alias_table {
+public:
+	explicit alias_table(const std::vector<float>& weights);
+
+	int size() const { return static_cast<int>(pdf.size()); }
+
+public:
+	std::vector<float> pdf;
+	std::vector<float> prob;
+	std::vector<int> alias;
+};
+
+inline alias_table::alias_table(const std::vector<float>& weights) :
+		pdf(weights.size()), prob(weights.size(), 1.0f), alias(weights.size()) {
+	const int n = size();
+	double total = 0;
+	for (float w : weights)
+		total += w;
+
+	// slots scaled so the average is 1; under-full slots are topped up by over-full ones
+	std::vector<double> scaled(n);
+	std::vector<int> small, large;
+	for (int i = 0; i < n; i++) {
+		alias[i] = i;
+		pdf[i] = total > 0 ? float(weights[i] / total) : 1.0f / n;
+		scaled[i] = double(pdf[i]) * n;
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty()) {
+		int s = small.back();
+		int l = large.back();
+		small.pop_back();
+		prob[s] = float(scaled[s]);
+		alias[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// what remains is full up to rounding
+	for (int i : small)
+		prob[i] = 1.0f;
+	for (int i : large)
+		prob[i] = 1.0f;
+}
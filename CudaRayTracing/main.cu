@@ -1,17 +1,30 @@
 ﻿
+#include "util.h"
+
+#ifdef USE_CUDA
 #include "cuda_runtime.h"
 #include "device_launch_parameters.h"
-#include "curand_kernel.h"
+#endif
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <time.h>
+#include <vector>
 
 #include "vec3.h"
 #include "ray.h"
-#include "sphere.h"
-#include "hittable_list.h"
+#include "bvh.h"
+#include "lbvh.h"
+#include "scene.h"
+#include "accel.h"
 #include "camera.h"
-#include "material.h"
-#include "pdf.h"
+#include "integrator.h"
+#include "checkpoint.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
 
 // Disable pedantic warnings for this external library.
 #ifdef _MSC_VER
@@ -31,6 +44,8 @@
 #pragma warning(pop)
 #endif
 
+#ifdef USE_CUDA
+
 #define checkCudaErrors(val) check_cuda( (val), #val, __FILE__, __LINE__ )
 
 void check_cuda(cudaError_t result, char const *const func, const char *const file, int const line) {
@@ -44,6 +59,8 @@ void check_cuda(cudaError_t result, char const *const func, const char *const fi
     }
 }
 
+#endif // USE_CUDA
+
 /*
 {
 	hit_record rec;
@@ -78,154 +95,621 @@ void check_cuda(cudaError_t result, char const *const func, const char *const fi
 }
 */
 
-GPU color ray_color(const ray& r, hittable** world, hittable** lights, curandState* local_rand) {
-    ray cur_ray = r;
-    vec3 cur_attenuation = vec3(1.0,1.0,1.0);
+// Scene selection: 0 = three spheres, 1 = a field of instanced sphere clusters over a two-level BVH,
+// 2 = a particle disc held in one sphere_soa, 3 = many lamps sampled through a light hierarchy or list,
+// 4 = a million spheres as separate primitives, to measure scene setup
+const int scene_id = 0;
+const int cluster_spheres = 16;
+const int instance_grid = 64;          ///> instance_grid * instance_grid instances of the cluster
+const int num_particles = 200000;
+const int particle_materials = 4;
+const int num_lamps = 48;              ///> the last two are floor panels
+const int field_spheres = 1000000;
+const int scene_seed = 1;              ///> seeds the host generator that places instances, particles and lamps
+// Many-lights sampling: light_bvh picks lamps by importance to the shading point, light_list by power alone
+const bool light_hierarchy = true;
+
+// An emitter of the many-lights scene: a sphere, or a square panel facing up
+struct lamp {
+    point3 center;
+    float size;                         ///> sphere radius or half the panel side
+    color emit;
+    bool panel;
+};
+
+// Memory visible to the host and to the backend that owns the scene (managed memory on CUDA)
+template<class T>
+T* shared_alloc(size_t n) {
+#ifdef USE_CUDA
+    T* ptr;
+    checkCudaErrors(cudaMallocManaged((void**)&ptr, n * sizeof(T)));
+    return ptr;
+#else
+    return new T[n];
+#endif
+}
 
-    for(int i = 0; i < 10; i++) {
-        hit_record rec;
-        if ((*world)->hit(cur_ray, 0.001f, FLT_MAX, rec)) {
-            ray scattered;
-            vec3 attenuation;
-            float pdf_val;
-            color emitted = rec.material_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+template<class T>
+void shared_free(T* ptr) {
+#ifdef USE_CUDA
+    checkCudaErrors(cudaFree(ptr));
+#else
+    delete[] ptr;
+#endif
+}
 
-            if(!rec.material_ptr->scatter(cur_ray, rec, attenuation, scattered, pdf_val, local_rand)) {
-                return cur_attenuation * emitted;
-            }
-            else {
-                auto p0 = hittable_pdf(rec.p, *lights);
-                auto p1 = cosine_pdf(rec.normal);
-                mixture_pdf mixed_pdf(&p0, &p1);
+// Diffuse material of one color
+int add_lambertian(scene_builder& world, const color& albedo) {
+    return world.add_material(lambertian(world.add_texture(solid_color(albedo))));
+}
 
-                scattered = ray(rec.p, mixed_pdf.generate(local_rand), r.time());
-                pdf_val = mixed_pdf.value(scattered.direction());
+int add_diffuse_light(scene_builder& world, const color& emit) {
+    return world.add_material(diffuse_light(world.add_texture(solid_color(emit))));
+}
 
-                cur_attenuation *= attenuation * rec.material_ptr->scattering_pdf(r, rec, scattered) / pdf_val;
-                cur_ray = scattered;
-            }
+// The scenes below add their primitives to world, the top-level ones to objects, pick the lights and
+// return the camera
+
+camera create_world(scene_builder& world, std::vector<int>& objects) {
+    objects.push_back(world.add(sphere(vec3(0, 0, -1), 0.5f, add_lambertian(world, color(0.8f, 0.3f, 0.3f)))));
+    objects.push_back(world.add(sphere(vec3(0, -100.5f, -1), 100, add_lambertian(world, color(0.8f, 0.8f, 0.2f)))));
+    objects.push_back(world.add(sphere(vec3(2, 2, -1), 0.25f, add_diffuse_light(world, color(1.0f, 1.0f, 1.0f)))));
+    world.set_light(objects.back());
+
+    point3 lookfrom(0, 0.25, 5);
+    point3 lookat(0, 0.5, 0);
+    vec3 vup(0, 1, 0);
+    auto aperture = 0.1;
+    return camera(lookfrom, lookat, vup, 45, 12.f/8.f, aperture, (lookat - lookfrom).length());
+}
+
+// The unique geometry of the instanced scene: a spiral of small spheres around the origin
+void create_cluster(scene_builder& world, std::vector<int>& objects) {
+    for (int i = 0; i < cluster_spheres; i++) {
+        float angle = 2.4f * i;
+        float t = float(i) / cluster_spheres;
+        point3 center(0.35f * cos(angle), 0.1f + 0.6f * t, 0.35f * sin(angle));
+        color albedo(0.2f + 0.7f * t, 0.3f + 0.4f * (1 - t), 0.8f - 0.5f * t);
+        objects.push_back(world.add(sphere(center, 0.1f, add_lambertian(world, albedo))));
+    }
+}
+
+// Places an instance of the cluster BVH per transform, followed by the ground and the light
+camera create_instances(scene_builder& world, int cluster, const std::vector<affine_transform>& transforms, std::vector<int>& objects) {
+    for (const affine_transform& transform : transforms) {
+        objects.push_back(world.add_instance(cluster, transform));
+    }
+    objects.push_back(world.add(sphere(vec3(0, -1000, 0), 1000, add_lambertian(world, color(0.5f, 0.5f, 0.5f)))));
+    objects.push_back(world.add(sphere(vec3(0, 30, 0), 8, add_diffuse_light(world, color(4.0f, 4.0f, 4.0f)))));
+    world.set_light(objects.back());
+
+    point3 lookfrom(0, 10, 45);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    return camera(lookfrom, lookat, vup, 45, 12.f/8.f, 0.0f, (lookat - lookfrom).length());
+}
+
+// Grid placement with a random rotation and scale per instance
+void instance_transforms(std::vector<affine_transform>& transforms) {
+    transforms.resize(instance_grid * instance_grid);
+    const float spacing = 1.2f;
+    for (int j = 0; j < instance_grid; j++) {
+        for (int i = 0; i < instance_grid; i++) {
+            vec3 offset((i - instance_grid / 2) * spacing, 0, (j - instance_grid / 2) * spacing);
+            transforms[j * instance_grid + i] = affine_transform::translate(offset)
+                * affine_transform::rotate_y(random_float(0, 360))
+                * affine_transform::scale(random_float(0.6f, 1.2f));
         }
-        else {
-            vec3 unit_direction = unit_vector(cur_ray.direction());
-            float t = 0.5f*(unit_direction.y() + 1.0f);
-            vec3 c = (1.0f - t) * vec3(1.0f, 1.0f, 1.0f) + t * vec3(0.5f, 0.7f, 1.0f);
-            return cur_attenuation * c;
+    }
+}
+
+// Particle scene: the particles are one sphere group, followed by the ground and the light
+camera create_particles(scene_builder& world, const sphere_soa_builder& particles, std::vector<int>& objects) {
+    // particle material ids count from the first of these
+    int first_material = add_lambertian(world, color(0.9f, 0.4f, 0.2f));
+    add_lambertian(world, color(0.2f, 0.5f, 0.9f));
+    add_lambertian(world, color(0.9f, 0.9f, 0.8f));
+    add_lambertian(world, color(0.4f, 0.8f, 0.3f));
+
+    objects.push_back(world.add_sphere_group(particles, first_material));
+    objects.push_back(world.add(sphere(vec3(0, -1000, 0), 1000, add_lambertian(world, color(0.5f, 0.5f, 0.5f)))));
+    objects.push_back(world.add(sphere(vec3(0, 30, 0), 8, add_diffuse_light(world, color(4.0f, 4.0f, 4.0f)))));
+    world.set_light(objects.back());
+
+    point3 lookfrom(0, 12, 40);
+    point3 lookat(0, 1, 0);
+    vec3 vup(0, 1, 0);
+    return camera(lookfrom, lookat, vup, 45, 12.f/8.f, 0.0f, (lookat - lookfrom).length());
+}
+
+// Particles spread over a disc, denser towards the middle
+void particle_disc(sphere_soa_builder& particles) {
+    for (int i = 0; i < num_particles; i++) {
+        float r = 20.0f * std::sqrt(random_float());
+        float angle = random_float(0, 2 * pi);
+        float height = 1.0f + random_float(-0.5f, 0.5f) * (1.0f - r / 25.0f);
+        particles.add(point3(r * cos(angle), height, r * sin(angle)), random_float(0.03f, 0.12f), i % particle_materials);
+    }
+}
+
+// Many-lights scene: lamps of very different power over a few diffuse spheres, sampled through a
+// light_bvh if light_nodes is given, otherwise a light_list over table
+camera create_lamps(scene_builder& world, const std::vector<lamp>& lamps, const std::vector<light_bvh_node>* light_nodes, const alias_table* table,
+                    std::vector<int>& objects) {
+    for (const lamp& l : lamps) {
+        int emitter = add_diffuse_light(world, l.emit);
+        if (l.panel) {
+            objects.push_back(world.add(xz_rect(l.center.x() - l.size, l.center.x() + l.size, l.center.z() - l.size, l.center.z() + l.size, l.center.y(), emitter)));
+        } else {
+            objects.push_back(world.add(sphere(l.center, l.size, emitter)));
         }
     }
-    return vec3(0.0,0.0,0.0); // exceeded recursion
+    std::vector<int> lamp_ids(objects.begin(), objects.end());
+    if (light_nodes) {
+        world.set_light_bvh(lamp_ids, *light_nodes);
+    } else {
+        world.set_light_list(lamp_ids, *table);
+    }
+
+    objects.push_back(world.add(sphere(vec3(0, -1000, 0), 1000, add_lambertian(world, color(0.5f, 0.5f, 0.5f)))));
+    objects.push_back(world.add(sphere(vec3(-4, 2, 0), 2, add_lambertian(world, color(0.8f, 0.3f, 0.3f)))));
+    objects.push_back(world.add(sphere(vec3(0, 2, -3), 2, add_lambertian(world, color(0.3f, 0.8f, 0.3f)))));
+    objects.push_back(world.add(sphere(vec3(4, 2, 0), 2, add_lambertian(world, color(0.3f, 0.3f, 0.8f)))));
+
+    point3 lookfrom(0, 9, 18);
+    point3 lookat(0, 1, 0);
+    vec3 vup(0, 1, 0);
+    return camera(lookfrom, lookat, vup, 45, 12.f/8.f, 0.0f, (lookat - lookfrom).length());
 }
 
-__global__ void create_world(hittable** d_list, hittable** d_world, hittable** lights, camera** cam) {
-    if (threadIdx.x == 0 && blockIdx.x == 0) {
-        *(d_list) = new sphere(vec3(0, 0, -1), 0.5f, new lambertian(new solid_color(0.8f, 0.3f, 0.3f)));
-        *(d_list + 1) = new sphere(vec3(0, -100.5f, -1), 100, new lambertian(new solid_color(0.8f, 0.8f, 0.2f)));
-        *(d_list + 2) = new sphere(vec3(2, 2, -1), 0.25f, new diffuse_light(new solid_color(1.0f, 1.0f, 1.0f)));
-        *d_world = new hittable_list(d_list, 3);
-        *lights = new sphere(vec3(2, 2, -1), 0.25f, new diffuse_light(new solid_color(1.0f, 1.0f, 1.0f)));
-
-        point3 lookfrom(0, 0.25, 5);
-        point3 lookat(0, 0.5, 0);
-        vec3 vup(0, 1, 0);
-        auto dist_to_focus = 10.0;
-        auto aperture = 0.1;
-        *cam = new camera(lookfrom, lookat, vup, 45, 12.f/8.f, aperture, (lookat - lookfrom).length());
+// Field scene: small spheres of a few materials scattered over the ground, each its own primitive in
+// the top-level BVH, followed by the ground and the light
+camera create_field(scene_builder& world, std::vector<int>& objects) {
+    int first_material = add_lambertian(world, color(0.9f, 0.4f, 0.2f));
+    add_lambertian(world, color(0.2f, 0.5f, 0.9f));
+    add_lambertian(world, color(0.9f, 0.9f, 0.8f));
+    add_lambertian(world, color(0.4f, 0.8f, 0.3f));
+
+    const float half_size = 100.0f;
+    objects.reserve(field_spheres + 2);
+    for (int i = 0; i < field_spheres; i++) {
+        float radius = random_float(0.05f, 0.2f);
+        point3 center(random_float(-half_size, half_size), radius, random_float(-half_size, half_size));
+        objects.push_back(world.add(sphere(center, radius, first_material + i % particle_materials)));
     }
+    objects.push_back(world.add(sphere(vec3(0, -1000, 0), 1000, add_lambertian(world, color(0.5f, 0.5f, 0.5f)))));
+    objects.push_back(world.add(sphere(vec3(0, 60, 0), 15, add_diffuse_light(world, color(4.0f, 4.0f, 4.0f)))));
+    world.set_light(objects.back());
+
+    point3 lookfrom(0, 15, 60);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    return camera(lookfrom, lookat, vup, 45, 12.f/8.f, 0.0f, (lookat - lookfrom).length());
 }
 
-__global__ void render_init(int w, int h, curandState* rand) {
-    int i = threadIdx.x + blockIdx.x * blockDim.x;
-    int j = threadIdx.y + blockIdx.y * blockDim.y;
+// Small lamps scattered around the spheres, a few of them far brighter than the rest, and two floor panels
+void lamp_layout(std::vector<lamp>& lamps) {
+    lamps.resize(num_lamps);
+    for (int i = 0; i < num_lamps - 2; i++) {
+        float angle = random_float(0, 2 * pi);
+        float r = random_float(3.0f, 9.0f);
+        color hue(random_float(0.2f, 1.0f), random_float(0.2f, 1.0f), random_float(0.2f, 1.0f));
+        float intensity = i % 12 == 0 ? 60.0f : random_float(1.0f, 6.0f);
+        lamps[i] = { point3(r * cos(angle), random_float(0.3f, 5.0f), r * sin(angle)), random_float(0.08f, 0.2f), intensity * hue, false };
+    }
+    lamps[num_lamps - 2] = { point3(-6, 0.01f, 5), 1.0f, color(3, 2.5f, 2), true };
+    lamps[num_lamps - 1] = { point3(6, 0.01f, 5), 1.0f, color(2, 2.5f, 3), true };
+}
 
-    if (i >= w || j >= h) {
-        return;
+// Emitted power up to a constant factor: radiance times emitting area
+float lamp_power(const lamp& l) {
+    float area = l.panel ? 4 * l.size * l.size : 4 * pi * l.size * l.size;
+    return luminance(l.emit) * area;
+}
+
+light_bounds lamp_bounds(const lamp& l) {
+    if (l.panel) {
+        vec3 half(l.size, 0.0001f, l.size);
+        return rect_light_bounds(aabb(l.center - half, l.center + half), vec3(0, 1, 0), lamp_power(l));
     }
+    return sphere_light_bounds(l.center, l.size, lamp_power(l));
+}
 
-    int pixel = j * w + i;
-    curand_init(42, pixel, 0, &rand[pixel]);
+// Adds samples to the pixel until it has `samples` of them, fewer once it meets the adaptive noise target
+GPU void render_pixel(int i, int j, int w, int h, int samples, const camera& cam, const scene& world, const path_settings& settings,
+                      pixel_accum& pixel) {
+    while (pixel.wants_samples(samples, settings)) {
+        rng local_rand = sample_rng(j * w + i, pixel, settings);
+        float u = float(i + cu_random_float(&local_rand)) / float(w);
+        float v = float(j + cu_random_float(&local_rand)) / float(h);
+        ray r = cam.get_ray(u, v, &local_rand);
+        color sample = ray_color(r, world, settings, &local_rand);
+        pixel.sum += sample;
+        pixel.stats.add(sample);
+    }
+}
+
+// BVH build settings: binned SAH for final frames, LBVH when the scene is rebuilt every frame
+const bool bvh_use_lbvh = false;
+const int bvh_leaf_size = 4;
+const int bvh_bins = 16;
+const int lbvh_morton_bits = 30;
+const int lbvh_treelet_passes = 2;
+const float bvh_rebuild_threshold = 1.3f;     ///> moving scenes refit until the SAH cost grows by this factor
+
+bvh_build_result build_scene_bvh(const std::vector<aabb>& boxes, thread_pool& pool, int leaf_size = bvh_leaf_size) {
+    if (bvh_use_lbvh) {
+        lbvh_builder builder(boxes, leaf_size, lbvh_morton_bits, lbvh_treelet_passes);
+        builder.build(&pool);
+        return std::move(builder);
+    }
+
+    bvh_builder builder(boxes, leaf_size, bvh_split_method::sah, bvh_bins);
+    builder.build(&pool);
+    return std::move(builder);
+}
+
+void log_bvh_stats(const bvh_build_result& bvh, int num_prims, const char* level) {
+    std::cerr << level << ": built " << (bvh_use_lbvh ? "LBVH" : "SAH BVH") << " over " << num_prims << " objects in " << bvh.build_ms
+              << " ms on " << bvh.build_threads << " threads: " << bvh.nodes.size() << " nodes, " << bvh.num_leaves
+              << " leaves, depth " << bvh.max_depth << ", SAH cost " << bvh.sah_cost() << std::endl;
+}
+
+// Builds or refits one level through update_accel and logs what it did
+void update_level(scene_builder& world, accel_level& level, thread_pool& pool, const char* name) {
+    bool rebuilt = update_accel(world, level, [&pool](const std::vector<aabb>& b) { return build_scene_bvh(b, pool); });
+    if (rebuilt) {
+        log_bvh_stats(level.tree.tree(), static_cast<int>(level.prims.size()), name);
+    } else {
+        std::cerr << name << ": refit in " << level.tree.update_ms << " ms, SAH cost " << level.tree.cost_ratio()
+                  << "x of the last build" << std::endl;
+    }
 }
 
-__global__ void render(vec3* fb, int w, int h, int samples, camera** cam, hittable** world, hittable** lights, curandState* rand) {
-    int i = threadIdx.x + blockIdx.x * blockDim.x;
-    int j = threadIdx.y + blockIdx.y * blockDim.y;
+// Device copy of a scene: one buffer holding all of its arrays packed; unused on the CPU backend
+struct scene_memory {
+    unsigned char* device = nullptr;
+    size_t bytes = 0;
+    double upload_ms = 0;
+};
+
+/**
+ * \brief The scene the render backend traces. The CPU backend traces the builder's arrays in place; on
+ * CUDA they are packed into pinned host memory and copied to the device in a single transfer, which
+ * free_scene releases. The builder is not changed afterwards.
+ */
+scene upload_scene(const scene_builder& builder, scene_memory& memory) {
+#ifdef USE_CUDA
+    auto start = std::chrono::steady_clock::now();
+    std::vector<size_t> layout = builder.packed_layout();
+    memory.bytes = layout.back();
+
+    unsigned char* staging;
+    checkCudaErrors(cudaMallocHost((void**)&staging, memory.bytes));
+    builder.pack(staging, layout);
+    checkCudaErrors(cudaMalloc((void**)&memory.device, memory.bytes));
+    checkCudaErrors(cudaMemcpy(memory.device, staging, memory.bytes, cudaMemcpyHostToDevice));
+    checkCudaErrors(cudaFreeHost(staging));
+
+    memory.upload_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return builder.packed_view(memory.device, layout);
+#else
+    (void)memory;
+    return builder.view();
+#endif
+}
 
-    if (i >= w || j >= h) {
+void free_scene(scene_memory& memory) {
+#ifdef USE_CUDA
+    checkCudaErrors(cudaFree(memory.device));
+#endif
+    memory = scene_memory();
+}
+
+#ifdef USE_CUDA
+
+// One progressive pass: brings every pixel of the film up to `samples` samples. One block per tile,
+// launched in the scheduler's order; the hardware hands blocks to free multiprocessors as they finish.
+__global__ void render(pixel_accum* film, const image_tile* tiles, int w, int h, int samples, camera cam, scene world, path_settings settings) {
+    const image_tile& tile = tiles[blockIdx.x];
+    int i = tile.x0 + threadIdx.x;
+    int j = tile.y0 + threadIdx.y;
+
+    if (i >= tile.x1 || j >= tile.y1) {
         return;
     }
 
     // pixel color info
     int pixel = j * w + i;
-    curandState local_rand = rand[pixel];
-    vec3 col(0, 0, 0);
-    for (int s = 0; s < samples; s++) {
-        float u = float(i + curand_uniform(&local_rand)) / float(w);
-        float v = float(j + curand_uniform(&local_rand)) / float(h);
-        ray r = (*cam)->get_ray(u, v, &local_rand);
-        col += ray_color(r, world, lights, &local_rand);
+    pixel_accum local_pixel = film[pixel];
+    render_pixel(i, j, w, h, samples, cam, world, settings, local_pixel);
+    film[pixel] = local_pixel;
+}
+
+#else
+
+// Primary rays of packet_width neighbouring pixels share one BVH traversal, then every path continues
+// as a single ray; the image is the same as with single rays
+const bool packet_tracing = true;
+
+// Runs the path tracer stage by stage over queues of paths instead of per tile; same image
+const bool wavefront = false;
+// Wavefront only: sort bounce rays by direction octant and origin Morton code before tracing them
+const bool ray_sorting = false;
+
+// Renders pixels i0 .. i0 + count - 1 of row j (count <= packet_width), one primary ray packet per sample
+void render_packet(pixel_accum* film, int i0, int j, int count, int w, int h, int samples, const camera& cam, const scene& world,
+                   const path_settings& settings) {
+    pixel_accum* pixels = film + j * w + i0;
+    int active = 0;
+    for (int l = 0; l < count; l++) {
+        active |= pixels[l].wants_samples(samples, settings) << l;
+    }
+
+    // lanes drop out of the packet as their pixels reach the sample count or the noise target
+    while (active) {
+        // each lane draws from its own sample's random stream, as render_pixel does
+        rng rand[packet_width];
+        rng* rands[packet_width];
+        ray rays[packet_width];
+        int first = -1;
+        for (int l = 0; l < packet_width; l++) {
+            rands[l] = &rand[l];
+        }
+        for (int l = 0; l < count; l++) {
+            if (!(active >> l & 1)) {
+                continue;
+            }
+            rand[l] = sample_rng(j * w + i0 + l, pixels[l], settings);
+            float u = float(i0 + l + cu_random_float(&rand[l])) / float(w);
+            float v = float(j + cu_random_float(&rand[l])) / float(h);
+            rays[l] = cam.get_ray(u, v, &rand[l]);
+            rand[l].start_slot(slot_medium);
+            first = first < 0 ? l : first;
+        }
+        for (int l = 0; l < packet_width; l++) {
+            if (!(active >> l & 1)) {
+                rays[l] = rays[first];
+            }
+        }
+
+        hit_record recs[packet_width];
+        packet_float t_max(FLT_MAX);
+        int hits = world.hit_packet(rays, packet_ray::gather(rays), active, 0.001f, t_max, recs, rands);
+        for (int l = 0; l < count; l++) {
+            if (!(active >> l & 1)) {
+                continue;
+            }
+            color sample = trace_path(rays[l], hits >> l & 1, recs[l], world, settings, &rand[l]);
+            pixels[l].sum += sample;
+            pixels[l].stats.add(sample);
+            if (!pixels[l].wants_samples(samples, settings)) {
+                active &= ~(1 << l);
+            }
+        }
+    }
+}
+
+// Renders the pixels in [x0, x1) x [y0, y1) up to `samples` samples; one call per tile job on the thread pool
+void render_tile(pixel_accum* film, int x0, int y0, int x1, int y1, int w, int h, int samples, const camera& cam, const scene& world,
+                 const path_settings& settings) {
+    for (int j = y0; j < y1; j++) {
+        if (packet_tracing) {
+            for (int i = x0; i < x1; i += packet_width) {
+                render_packet(film, i, j, std::min(packet_width, x1 - i), w, h, samples, cam, world, settings);
+            }
+            continue;
+        }
+
+        for (int i = x0; i < x1; i++) {
+            render_pixel(i, j, w, h, samples, cam, world, settings, film[j * w + i]);
+        }
     }
-    fb[pixel] = col / samples;
 }
 
-__global__ void free_world(hittable** d_list, hittable** d_world, hittable** lights, camera** cam) {
-    delete *(d_list);
-    delete *(d_list + 1);
-    delete *d_world;
-    delete *lights;
-    delete cam;
+#endif // USE_CUDA
+
+// Set on SIGINT or SIGTERM: the render stops after the current pass, checkpoints and writes what it has
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+    stop_requested = 1;
 }
 
 int main() {
     const int width = 1200;
     const int height = 800;
     const int channel_num = 3;
-    const int num_pixels = width * height * channel_num;
-    size_t fb_size = num_pixels * sizeof(vec3);
-
-    // Setup world
-    std::cerr << "Setting up world" << std::endl;
-    hittable** obj_list;
-    checkCudaErrors(cudaMalloc((void**)&obj_list, 2 * sizeof(hittable *)));
-    hittable** world;
-    checkCudaErrors(cudaMalloc((void**)&world, 2 * sizeof(hittable *)));
-    camera** cam;
-    checkCudaErrors(cudaMalloc((void **)&cam, sizeof(camera *)));
-    hittable** lights;
-    checkCudaErrors(cudaMalloc((void**)&lights, sizeof(hittable *)));
-
-    create_world<<<1, 1>>>(obj_list, world, lights, cam);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaDeviceSynchronize());
-
-    // Setup and render
-    std::cerr << "Initializing render" << std::endl;
-    curandState* rand_state;
-    checkCudaErrors(cudaMalloc((void**)&rand_state, num_pixels * sizeof(curandState)));
-
-    vec3* fb;
-    checkCudaErrors(cudaMallocManaged((void**)&fb, fb_size));
+    const int num_pixels = width * height;
 
+    // tile size (the thread block on CUDA) and the order tiles are handed out in
     const int cr_x = 16;
     const int cr_y = 16;
+    const tile_order tile_ordering = tile_order::hilbert;
     const int samples_per_pixel = 1000;
-    
-    clock_t start, stop;
-    start = clock();
 
-    dim3 blocks(width/cr_x + 1, height/cr_y + 1);
+    // progressive rendering: passes of pass_samples, with the film saved to checkpoint_path every
+    // checkpoint_seconds; a run finding a matching checkpoint resumes from it
+    const int pass_samples = 16;
+    const double checkpoint_seconds = 60;
+    const char* checkpoint_path = "render.ckpt";
+
+    // path length: max_depth bounces at most, Russian roulette from rr_min_depth on
+    path_settings settings;
+    settings.max_depth = 10;
+    settings.rr_min_depth = 3;
+    settings.sky = scene_id == 3 ? 0.0f : 1.0f;
+
+    // adaptive sampling: a pixel stops after min_samples once its relative standard error drops below noise_target
+    settings.min_samples = 64;
+    settings.noise_target = 0.02f;
+
+    // host worker threads: BVH construction on both backends, tile rendering on the CPU backend;
+    // seeded first, so the workers' generators follow from scene_seed as well
+    seed_random(scene_seed);
+    thread_pool pool;
+    pool.start();
+
+    // Setup world: built on the host, then handed to the render backend as flat arrays
+    std::cerr << "Setting up world" << std::endl;
+    auto setup_start = std::chrono::steady_clock::now();
+    scene_builder builder;
+    camera cam;
+    scene_accel accel(bvh_rebuild_threshold);
+    if (scene_id == 1) {
+        // bottom level: the cluster geometry exists once, every instance references its BVH
+        accel_level& cluster_level = accel.add_bottom();
+        create_cluster(builder, cluster_level.prims);
+        update_level(builder, cluster_level, pool, "BLAS");
+
+        std::vector<affine_transform> transforms;
+        instance_transforms(transforms);
+        cam = create_instances(builder, cluster_level.bvh, transforms, accel.top.prims);
+    } else if (scene_id == 2) {
+        // the particles carry their own BVH with batch-sized leaves; the top level only sees one object
+        sphere_soa_builder particles;
+        particle_disc(particles);
+        particles.build([&pool](const std::vector<aabb>& b, int leaf_size) { return build_scene_bvh(b, pool, leaf_size); });
+        log_bvh_stats(particles.bvh, particles.size(), "Particles");
+        cam = create_particles(builder, particles, accel.top.prims);
+    } else if (scene_id == 3) {
+        // every shadow ray picks one lamp, by importance through the hierarchy or by power from the list
+        std::vector<lamp> lamps;
+        lamp_layout(lamps);
+        if (light_hierarchy) {
+            light_bvh_builder light_tree;
+            for (const lamp& l : lamps) {
+                light_tree.add(lamp_bounds(l));
+            }
+            light_tree.build();
+            cam = create_lamps(builder, lamps, &light_tree.nodes, nullptr, accel.top.prims);
+        } else {
+            std::vector<float> powers;
+            for (const lamp& l : lamps) {
+                powers.push_back(lamp_power(l));
+            }
+            alias_table table(powers);
+            cam = create_lamps(builder, lamps, nullptr, &table, accel.top.prims);
+        }
+    } else if (scene_id == 4) {
+        cam = create_field(builder, accel.top.prims);
+    } else {
+        cam = create_world(builder, accel.top.prims);
+    }
+    update_level(builder, accel.top, pool, scene_id == 0 ? "BVH" : "TLAS");
+    builder.set_top_level(accel.top.bvh);
+
+    scene_memory memory;
+    const scene world = upload_scene(builder, memory);
+    double setup_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - setup_start).count();
+    std::cerr << "Scene setup: " << builder.num_primitives() << " primitives in " << setup_ms << " ms";
+#ifdef USE_CUDA
+    std::cerr << ", " << memory.bytes / 1e6 << " MB uploaded in one transfer in " << memory.upload_ms << " ms" << std::endl;
+#else
+    std::cerr << ", traced in place" << std::endl;
+#endif
+
+    // the film carries every pixel's sum and statistics from pass to pass
+    pixel_accum* film = shared_alloc<pixel_accum>(num_pixels);
+    const checkpoint_key key = make_checkpoint_key(width, height, scene_id, scene_seed, builder.light_type, settings);
+    int samples_done = 0;
+    bool resumed = load_checkpoint(checkpoint_path, key, samples_done, film, num_pixels);
+    if (resumed) {
+        std::cerr << "Resuming from " << checkpoint_path << " at " << samples_done << " samples per pixel" << std::endl;
+    } else {
+        std::fill(film, film + num_pixels, pixel_accum());
+    }
+
+    tile_scheduler scheduler(width, height, cr_x, cr_y, tile_ordering);
+
+#ifdef USE_CUDA
     dim3 threads(cr_x, cr_y);
-    render_init<<<blocks, threads>>>(width, height, rand_state);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaDeviceSynchronize());
+    image_tile* tiles = shared_alloc<image_tile>(scheduler.size());
+    memcpy(tiles, scheduler.tiles.data(), scheduler.size() * sizeof(image_tile));
+
+    auto render_pass = [&](int samples) {
+        render<<<scheduler.size(), threads>>>(film, tiles, width, height, samples, cam, world, settings);
+        checkCudaErrors(cudaGetLastError());
+        checkCudaErrors(cudaDeviceSynchronize());
+    };
+#else
+    wavefront_integrator integrator(pool, width, height, cam, world, settings);
+    integrator.sort_rays = ray_sorting;
+
+    auto render_pass = [&](int samples) {
+        if (wavefront) {
+            integrator.render(film, samples);
+            return;
+        }
+        scheduler.run(pool, [&](const image_tile& tile) {
+            render_tile(film, tile.x0, tile.y0, tile.x1, tile.y1, width, height, samples, cam, world, settings);
+        });
+    };
+#endif
+
+    double resumed_samples = 0;
+    for (int p = 0; p < num_pixels; p++) {
+        resumed_samples += film[p].stats.n;
+    }
+
+    // a pre-empted job gets SIGTERM (Ctrl+C sends SIGINT) and saves the film before it exits
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
 
     std::cerr << "Starting render" << std::endl;
-    render<<<blocks, threads>>>(fb, width, height, samples_per_pixel, cam, world, lights, rand_state);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaDeviceSynchronize());
+    auto start = std::chrono::steady_clock::now();
+    auto last_checkpoint = start;
+    while (samples_done < samples_per_pixel && !stop_requested) {
+        samples_done = std::min(samples_per_pixel, samples_done + pass_samples);
+        render_pass(samples_done);
+        std::cerr << "\rPass done: " << samples_done << " / " << samples_per_pixel << " samples per pixel" << std::flush;
+
+        auto now = std::chrono::steady_clock::now();
+        if (samples_done < samples_per_pixel && (stop_requested || std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_seconds)) {
+            if (!save_checkpoint(checkpoint_path, key, samples_done, film, num_pixels)) {
+                std::cerr << "\nERROR::Checkpoint: failed to write " << checkpoint_path << std::endl;
+            }
+            last_checkpoint = now;
+        }
+    }
+    std::cerr << std::endl;
+    auto stop = std::chrono::steady_clock::now();
+    pool.stop();
+
+    const bool finished = samples_done >= samples_per_pixel;
+    if (finished) {
+        std::remove(checkpoint_path);
+    } else {
+        std::cerr << "Stopped at " << samples_done << " samples per pixel, run again to resume from " << checkpoint_path << std::endl;
+    }
 
-    stop = clock();
-    double timer_seconds = ((double)(stop - start)) / CLOCKS_PER_SEC;
+    // Film --> frame buffer
+    vec3* fb = shared_alloc<vec3>(num_pixels);
+    double total_samples = 0;
+    int min_samples = samples_per_pixel;
+    int max_samples = 0;
+    for (int p = 0; p < num_pixels; p++) {
+        int n = film[p].stats.n;
+        fb[p] = n > 0 ? film[p].sum / n : vec3(0, 0, 0);
+        total_samples += n;
+        min_samples = std::min(min_samples, n);
+        max_samples = std::max(max_samples, n);
+    }
+
+    double timer_seconds = std::chrono::duration<double>(stop - start).count();
+    double samples_per_second = (total_samples - resumed_samples) / timer_seconds;
     std::cerr << "Finished render\n";
     std::cerr << "Took " << timer_seconds << " seconds" << std::endl;
-
+    std::cerr << "Samples per pixel: " << total_samples / num_pixels << " average, " << min_samples << " min, " << max_samples << " max" << std::endl;
+#ifdef USE_CUDA
+    std::cerr << "Throughput: " << samples_per_second / 1e6 << " Msamples/s" << std::endl;
+#else
+    std::cerr << "Throughput: " << samples_per_second / 1e6 << " Msamples/s on " << pool.num_threads() << " threads ("
+              << samples_per_second / pool.num_threads() / 1e6 << " Msamples/s per thread)" << std::endl;
+    if (wavefront) {
+        integrator.print_stage_times(std::cerr);
+    }
+#endif
     // Frame buffer --> image
     auto* pixels = new unsigned char[width * height * channel_num];
     for (int j = 0; j < height; j++) {
@@ -254,18 +738,31 @@ int main() {
 		std::cerr << "ERROR::Write_JPG: Image failed to save with code " << err << '\n';
 	}
 
+    // samples taken per pixel, white at samples_per_pixel
+    for (int p = 0; p < num_pixels; p++) {
+        pixels[p] = (unsigned char)(255.99f * std::min(film[p].stats.n, samples_per_pixel) / samples_per_pixel);
+    }
+    if (!stbi_write_jpg("sample_map.jpg", width, height, 1, pixels, 100)) {
+        std::cerr << "ERROR::Write_JPG: Sample map failed to save\n";
+    }
+
     // clean up
+#ifdef USE_CUDA
     checkCudaErrors(cudaDeviceSynchronize());
-    free_world<<<1,1>>>(obj_list, world, lights, cam);
-    checkCudaErrors(cudaGetLastError());
-    checkCudaErrors(cudaFree(obj_list));
-    checkCudaErrors(cudaFree(world));
-    checkCudaErrors(cudaFree(fb));
+#endif
+    free_scene(memory);
+    shared_free(fb);
+    shared_free(film);
     delete[] pixels;
+#ifdef USE_CUDA
+    shared_free(tiles);
 
     // useful for cuda-memcheck --leak-check full
     cudaDeviceReset();
+#endif
 
+#ifdef _WIN32
     system("pause");
+#endif
     return 0;
 }
\ No newline at end of file
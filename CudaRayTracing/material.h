@@ -6,77 +6,90 @@
 #include "texture.h"
 #include "util.h"
 
-struct hit_record;
+#include <cstdint>
+
+enum class material_type : uint8_t {
+	lambertian,
+	metal,
+	dielectric,
+	diffuse_light,
+	isotropic
+};
 
-class material {
-public:
-	GPU virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, float& pdf, curandState* local_rand) const {
-		return false;
-	}
+/**
+ * \brief Material as a tagged union: type selects the scattering model in a switch, so the scene's
+ * materials are a plain array built on the host, with no vtables to create on the device.
+ * texture is an index into the texture_set passed to scatter() and emitted().
+ */
+struct material {
+	material_type type;
+	int texture;		///> albedo, or the emission of diffuse_light; unused by dielectric
+	float param;		///> metal: roughness, dielectric: index of refraction
 
-	GPU virtual float scattering_pdf(const ray& r_in, const hit_record& rec, ray& scattered) const {
-		return 0;
-	}
+	GPU bool scatter(const ray& r_in, const hit_record& rec, const texture_set& textures, color& attenuation, ray& scattered, float& pdf,
+			rng* local_rand) const;
 
-	GPU virtual color emitted(const ray& r_in, const hit_record& rec, float u, float v, const point3& p) const {
-		return color(0, 0, 0);
-	}
-};
+	GPU float scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const;
 
-class lambertian : public material {
-public:
-	//XPU lambertian(const color& a) :
-	//		albedo(std::make_shared<solid_color>(a)) {}
+	// Specular materials scatter into a single direction, so they have no pdf to sample lights against
+	XPU bool is_specular() const {
+		return type == material_type::metal || type == material_type::dielectric;
+	}
 
-	GPU lambertian(cu_texture* a) :
-			albedo(a) {}
+	GPU color emitted(const ray& r_in, const hit_record& rec, const texture_set& textures, float u, float v, const point3& p) const;
+};
 
-	GPU virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, float& pdf, curandState* local_rand) const override {
+inline material lambertian(int albedo) {
+	return { material_type::lambertian, albedo, 0 };
+}
+
+inline material metal(int albedo, float roughness) {
+	return { material_type::metal, albedo, roughness < 1 ? roughness : 1 };
+}
+
+inline material dielectric(float ior) {
+	return { material_type::dielectric, -1, ior };
+}
+
+inline material diffuse_light(int emit) {
+	return { material_type::diffuse_light, emit, 0 };
+}
+
+inline material isotropic(int albedo) {
+	return { material_type::isotropic, albedo, 0 };
+}
+
+// Use Schlick's approximation for reflectance (varying reflectivity by angle)
+GPU inline float reflectance(float cosine, float ref_idx) {
+	float r0 = (1 - ref_idx) / (1 + ref_idx);
+	r0 = r0 * r0;
+	return r0 + (1 - r0) * pow(1 - cosine, 5.0f);
+}
+
+GPU inline bool material::scatter(const ray& r_in, const hit_record& rec, const texture_set& textures, color& attenuation, ray& scattered,
+		float& pdf, rng* local_rand) const {
+	switch (type) {
+	case material_type::lambertian: {
 		onb uvw;
 		uvw.build_from_w(rec.normal);
 		vec3 scatter_dir = uvw.local(cu_random_cosine_direction(local_rand));
 
 		scattered = ray(rec.p, cu_unit_vector(scatter_dir), r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		attenuation = textures.value(texture, rec.u, rec.v, rec.p);
 		pdf = cu_dot(uvw.w(), scattered.direction()) / pi;
 		return true;
 	}
 
-	GPU float scattering_pdf(const ray& r_in, const hit_record& rec, ray& scattered) const override {
-		float cosine = cu_dot(rec.normal, scattered.direction());
-		return cosine < 0 ? 0 : (cosine / pi);
-	}
-
-public:
-	cu_texture* albedo;
-};
-
-class metal : public material {
-public:
-	//XPU metal(const color& a, const float r) :
-	//		albedo(std::make_shared<solid_color>(a)), roughness(r < 1 ? r : 1) {}
-
-	GPU metal(cu_texture* a, const float r) :
-			albedo(a), roughness(r < 1 ? r : 1) {}
-
-	GPU virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, float& pdf, curandState* local_rand) const override {
+	case material_type::metal: {
+		const float roughness = param;
 		vec3 reflect_dir = reflect(cu_unit_vector(r_in.direction()), rec.normal);
 		scattered = ray(rec.p, reflect_dir + roughness * cu_random_in_unit_sphere(local_rand), r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
+		attenuation = textures.value(texture, rec.u, rec.v, rec.p);
 		return cu_dot(scattered.direction(), rec.normal) > 0.0f;
 	}
 
-public:
-	cu_texture* albedo;
-	float roughness;
-};
-
-class dielectric : public material {
-public:
-	GPU dielectric(float ior) :
-			ir(ior) {}
-
-	GPU virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, float& pdf, curandState* local_rand) const override {
+	case material_type::dielectric: {
+		const float ir = param;
 		attenuation = color(1, 1, 1);
 		float refraction_ratio = rec.front_face ? (1.0f / ir) : ir;
 
@@ -98,52 +111,34 @@ public:
 		return true;
 	}
 
-public:
-	float ir;
-
-private:
-	GPU static float reflectance(float cosine, float ref_idx) {
-		// Use Schlick's approximation for reflectance (varying reflectivity by angle)
-		float r0 = (1 - ref_idx) / (1 + ref_idx);
-		r0 = r0 * r0;
-		return r0 + (1 - r0) * pow(1 - cosine, 5.0f);
-	}
-};
-
-class diffuse_light : public material {
-public:
-	GPU diffuse_light(cu_texture* a) :
-			emit(a) {}
-
-	//XPU diffuse_light(color c) :
-	//		emit(std::make_shared<solid_color>(c)) {}
+	case material_type::isotropic:
+		scattered = ray(rec.p, cu_random_in_unit_sphere(local_rand), r_in.time());
+		attenuation = textures.value(texture, rec.u, rec.v, rec.p);
+		pdf = 1 / (4 * pi);
+		return true;
 
-	GPU virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, float& pdf, curandState* local_rand) const override {
+	default:
 		return false;
 	}
+}
 
-	GPU virtual color emitted(const ray& r_in, const hit_record& rec, float u, float v, const point3& p) const override {
-		if (rec.front_face)
-			return emit->value(u, v, p);
-		return color(0, 0, 0);
+GPU inline float material::scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+	switch (type) {
+	case material_type::lambertian: {
+		float cosine = cu_dot(rec.normal, scattered.direction());
+		return cosine < 0 ? 0 : (cosine / pi);
 	}
 
-public:
-	cu_texture* emit;
-};
-
-class isotropic : public material {
-public:
-	//XPU isotropic(color c) : albedo(std::make_shared<solid_color>(c)) {}
+	case material_type::isotropic:
+		return 1 / (4 * pi);
 
-	GPU isotropic(cu_texture* a) : albedo(a) {}
-
-	GPU virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, float& pdf, curandState* local_rand) const override {
-		scattered = ray(rec.p, cu_random_in_unit_sphere(local_rand), r_in.time());
-		attenuation = albedo->value(rec.u, rec.v, rec.p);
-		return true;
+	default:
+		return 0;
 	}
+}
 
-public:
-	cu_texture* albedo;
-};
\ No newline at end of file
+GPU inline color material::emitted(const ray& r_in, const hit_record& rec, const texture_set& textures, float u, float v, const point3& p) const {
+	if (type == material_type::diffuse_light && rec.front_face)
+		return textures.value(texture, u, v, p);
+	return color(0, 0, 0);
+}
@@ -3,17 +3,17 @@
 #include "util.h"
 #include "hittable.h"
 
-class moving_sphere : public hittable {
+class moving_sphere {
 public:
-	moving_sphere() {}
-	moving_sphere(point3 c0, point3 c1, float t0, float t1, float r, std::shared_ptr<material> m) :
-			center0(c0), center1(c1), time0(t0), time1(t1), radius(r), material_ptr(m) {
+	XPU moving_sphere() {}
+	XPU moving_sphere(point3 c0, point3 c1, float t0, float t1, float r, int m) :
+			center0(c0), center1(c1), time0(t0), time1(t1), radius(r), material_id(m) {
 	}
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
-	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override;
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	XPU bool bounding_box(float t0, float t1, aabb& output_box) const;
 
-	point3 center(float time) const {
+	XPU point3 center(float time) const {
 		return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 	};
 
@@ -21,10 +21,10 @@ public:
 	point3 center0, center1;
 	float time0, time1;
 	float radius;
-	std::shared_ptr<material> material_ptr;
+	int material_id;
 };
 
-inline bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+XPU inline bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
 	// implements simplified quadratic equation for vector dotted with itself
 	vec3 oc = r.origin() - center(r.time());
 	float a = r.direction().length_squared();
@@ -50,12 +50,12 @@ inline bool moving_sphere::hit(const ray& r, float t_min, float t_max, hit_recor
 	rec.p = r.at(rec.t);
 	vec3 outward_normal = (rec.p - center(r.time())) / radius;
 	rec.set_face_normal(r, outward_normal);
-	rec.material_ptr = material_ptr;
+	rec.material_id = material_id;
 
 	return true;
 }
 
-inline bool moving_sphere::bounding_box(float t0, float t1, aabb& output_box) const {
+XPU inline bool moving_sphere::bounding_box(float t0, float t1, aabb& output_box) const {
 	aabb box0(
 			center(t0) - vec3(radius, radius, radius),
 			center(t0) + vec3(radius, radius, radius));
@@ -2,24 +2,21 @@
 #include "onb.h"
 #include "vec3.h"
 
-class pdf {
-public:
-	GPU virtual ~pdf() {}
-
-	GPU virtual float value(const vec3& direction) const = 0;
-	GPU virtual vec3 generate(curandState* local_rand) const = 0;
-};
+/*
+ * Direction pdfs provide value(direction) and generate(rng*). They are composed as templates rather
+ * than through a virtual base, so the device code calling them needs no vtables.
+ */
 
-class cosine_pdf : public pdf {
+class cosine_pdf {
 public:
 	GPU cosine_pdf(const vec3& w) { uvw.build_from_w(w); }
 
-	GPU virtual float value(const vec3& direction) const override {
+	GPU float value(const vec3& direction) const {
 		float cosine = cu_dot(cu_unit_vector(direction), uvw.w());
 		return cosine < 0 ? 0 : (cosine / pi);
 	}
 
-	GPU virtual vec3 generate(curandState* local_rand) const override {
+	GPU vec3 generate(rng* local_rand) const {
 		return uvw.local(cu_random_cosine_direction(local_rand));
 	}
 
@@ -27,42 +24,44 @@ public:
 	onb uvw;
 };
 
-class hittable_pdf : public pdf {
+// Directions toward the lights of a scene, which provides light_pdf_value() and light_random()
+template<class S>
+class light_pdf {
 public:
-	GPU hittable_pdf(const point3& origin, hittable* p) :
-			o(origin), ptr(p) {}
+	GPU light_pdf(const point3& origin, const S& s) :
+			o(origin), world(&s) {}
 
-	GPU virtual float value(const vec3& direction) const override {
-		return ptr->pdf_value(o, direction);
+	GPU float value(const vec3& direction) const {
+		return world->light_pdf_value(o, direction);
 	}
 
-	GPU virtual vec3 generate(curandState* local_rand) const override {
-		return ptr->random(o, local_rand);
+	GPU vec3 generate(rng* local_rand) const {
+		return world->light_random(o, local_rand);
 	}
 
 public:
 	point3 o;
-	hittable* ptr;
+	const S* world;
 };
 
-class mixture_pdf : public pdf {
+template<class P0, class P1>
+class mixture_pdf {
 public:
-	GPU mixture_pdf(pdf* p0, pdf* p1) {
-		p[0] = p0;
-		p[1] = p1;
-	}
+	GPU mixture_pdf(const P0& pdf0, const P1& pdf1) :
+			p0(pdf0), p1(pdf1) {}
 
-	GPU virtual float value(const vec3& direction) const override {
-		return 0.5f * p[0]->value(direction) + 0.5f * p[1]->value(direction);
+	GPU float value(const vec3& direction) const {
+		return 0.5f * p0.value(direction) + 0.5f * p1.value(direction);
 	}
 
-	GPU virtual vec3 generate(curandState* local_rand) const override {
+	GPU vec3 generate(rng* local_rand) const {
 		if (cu_random_float(local_rand) < 0.5f)
-			return p[0]->generate(local_rand);
+			return p0.generate(local_rand);
 		else
-			return p[1]->generate(local_rand);
+			return p1.generate(local_rand);
 	}
 
 public:
-	pdf* p[2];
+	const P0& p0;
+	const P1& p1;
 };
@@ -2,28 +2,26 @@
 #include "util.h"
 #include "vec3.h"
 
+/**
+ * \brief Perlin noise lattice: random gradients and three permutation tables, held by value so noise
+ * textures can refer to it by index in the scene's arrays on either backend
+ */
 class perlin {
 public:
-	perlin() {
-		ranvec = new vec3[point_count];
+	static const int point_count = 256;
 
+	// Fills the tables from the calling thread's host generator
+	void generate() {
 		for (int i = 0; i < point_count; i++) {
 			ranvec[i] = unit_vector(vec3::random(-1, 1));
 		}
 
-		perm_x = perlin_generate_perm();
-		perm_y = perlin_generate_perm();
-		perm_z = perlin_generate_perm();
-	}
-
-	~perlin() {
-		delete[] ranvec;
-		delete[] perm_x;
-		delete[] perm_y;
-		delete[] perm_z;
+		perlin_generate_perm(perm_x);
+		perlin_generate_perm(perm_y);
+		perlin_generate_perm(perm_z);
 	}
 
-	float noise(const point3& p) const {
+	XPU float noise(const point3& p) const {
 		float u = p.x() - floor(p.x());
 		float v = p.y() - floor(p.y());
 		float w = p.z() - floor(p.z());
@@ -43,7 +41,7 @@ public:
 		return perlin_interpolate(c, u, v, w);
 	}
 
-	float turbulence(const point3& p, int depth = 7) const {
+	XPU float turbulence(const point3& p, int depth = 7) const {
 		float accum = 0.0f;
 		auto temp_p = p;
 		float weight = 1.0f;
@@ -58,20 +56,16 @@ public:
 	}
 
 private:
-	static const int point_count = 256;
-	vec3* ranvec;
-	int* perm_x;
-	int* perm_y;
-	int* perm_z;
-
-	static int* perlin_generate_perm() {
-		auto p = new int[point_count];
+	vec3 ranvec[point_count];
+	int perm_x[point_count];
+	int perm_y[point_count];
+	int perm_z[point_count];
 
-		for (unsigned int i = 0; i < perlin::point_count; i++)
+	static void perlin_generate_perm(int* p) {
+		for (int i = 0; i < perlin::point_count; i++)
 			p[i] = i;
 
 		permute(p, point_count);
-		return p;
 	}
 
 	static void permute(int* p, int n) {
@@ -83,7 +77,7 @@ private:
 		}
 	}
 
-	static float perlin_interpolate(vec3 c[2][2][2], float u, float v, float w) {
+	XPU static float perlin_interpolate(vec3 c[2][2][2], float u, float v, float w) {
 		// with Hermitian smoothing
 		float uu = u * u * (3 - 2 * u);
 		float vv = v * v * (3 - 2 * v);
@@ -98,7 +92,7 @@ private:
 							(j * vv + (1 - j) * (1 - vv)) *
 							(k * ww + (1 - k) * (1 - ww)) * dot(c[i][j][k], weight_v);
 				}
-			
+
 		return accum;
 	}
 };
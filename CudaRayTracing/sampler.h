@@ -0,0 +1,147 @@
+#pragma once
+
+#include "util.h"
+
+#include <cstdint>
+
+XPU inline uint32_t reverse_bits(uint32_t x) {
+#ifdef __CUDA_ARCH__
+	return __brev(x);
+#else
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+#endif
+}
+
+// Owen scrambling of a bit-reversed x: every bit is flipped depending on the bits below it
+// (Laine and Karras 2011, with the hash of Burley 2020)
+XPU inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Owen scrambling of x: every bit is flipped depending on the bits above it
+XPU inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Second dimension of the Sobol sequence, bit-reversed; the first is the index itself in that order.
+// Its generator matrix is Pascal's triangle mod 2, so bit m of the result is the parity of the index
+// bits k with m a bit subset of k (Lucas), which five masked shifts compute
+XPU inline uint32_t sobol_second_dimension_reversed(uint32_t index) {
+	index ^= (index >> 1) & 0x55555555u;
+	index ^= (index >> 2) & 0x33333333u;
+	index ^= (index >> 4) & 0x0f0f0f0fu;
+	index ^= (index >> 8) & 0x00ff00ffu;
+	index ^= (index >> 16) & 0x0000ffffu;
+	return index;
+}
+
+enum class sampler_type {
+	independent,	///> uncorrelated uniforms
+	sobol			///> 2D Sobol points, shuffled and Owen-scrambled per pixel and dimension pair
+};
+
+/*
+ * Dimension groups of a sample. Bounce 0 is the camera, bounce b > 0 the b-th surface hit; each group
+ * numbers its draws from 0, so a rejection loop or a material that draws more numbers does not shift
+ * the dimensions of the groups after it.
+ */
+enum rng_slot {
+	slot_pixel = 0,			///> camera: position within the pixel (2D)
+	slot_lens = 1,			///> camera: point on the lens (2D)
+	slot_time = 2,			///> camera: shutter time
+	slot_scatter = 0,		///> bounce: the material's own sample
+	slot_light_select = 1,	///> bounce: which light to sample
+	slot_light_sample = 2,	///> bounce: point on that light (2D)
+	slot_roulette = 3,		///> bounce: Russian roulette
+	slot_medium = 4,		///> camera or bounce: free flights through media along the ray it sends
+	slot_shadow_medium = 5,	///> bounce: the same along its shadow ray
+	num_slots = 6
+};
+
+/**
+ * \brief Counter-based random stream: every number follows from where it is drawn (pixel, sample index,
+ * bounce, slot and the index of the draw within the slot), so a stream keeps no state between samples
+ * and any sample of any pixel can be regenerated on its own. The same code runs on host and device.
+ *
+ * The independent sampler draws each slot as a PCG32 sequence starting at a hash of its position. The
+ * Sobol sampler pairs up the draws of a slot into 2D points of the Sobol (0,2)-sequence, indexed by the
+ * sample index; every pair has its own shuffle of the sample order and its own Owen scramble, so
+ * different pairs are uncorrelated while each stays stratified over the pixel's samples.
+ */
+struct rng {
+	XPU rng() :
+			rng(0, 0) {}
+	XPU rng(uint32_t pixel, uint32_t sample_index, sampler_type sampler = sampler_type::independent, uint32_t seed = 42) :
+			pixel_key(mix64(uint64_t(seed) << 32 | pixel)), sample_key(mix64(pixel_key + sample_index)), sample(sample_index), type(sampler) {
+		start(0, slot_pixel);
+	}
+
+	// Moves to the first slot of a bounce
+	XPU void start_bounce(uint32_t bounce_index) { start(bounce_index, slot_scatter); }
+
+	// Moves to another slot of the current bounce
+	XPU void start_slot(int slot) { start(bounce, slot); }
+
+	XPU void start(uint32_t bounce_index, int slot) {
+		bounce = bounce_index;
+		dimension = bounce_index * num_slots + slot;
+		draw = 0;
+		if (type == sampler_type::independent)
+			state = mix64(sample_key + dimension);
+	}
+
+	uint64_t pixel_key;		///> hash of seed and pixel, shared by the pixel's samples
+	uint64_t sample_key;	///> hash of pixel_key and sample
+	uint32_t sample;
+	sampler_type type;
+	uint32_t bounce = 0;
+	uint32_t dimension = 0;	///> bounce * num_slots + slot
+	uint32_t draw = 0;		///> draws taken in the current slot
+	uint64_t state = 0;		///> PCG32 state of the independent sampler
+	uint32_t pending = 0;	///> second coordinate of the Sobol sampler's current pair
+};
+
+// Both coordinates of a pair come from one point, so the second is kept for the next draw. The
+// points are scrambled while still bit-reversed, which saves reversing them twice
+XPU inline uint32_t sobol_next(rng* r) {
+	if (r->draw++ & 1)
+		return r->pending;
+
+	uint32_t pair = r->draw >> 1;
+	uint64_t hash = mix64(r->pixel_key ^ (uint64_t(r->dimension) << 32 | pair));
+	uint32_t seed = static_cast<uint32_t>(hash >> 32);
+	uint32_t index = nested_uniform_scramble(r->sample, static_cast<uint32_t>(hash));
+	r->pending = reverse_bits(laine_karras_permutation(sobol_second_dimension_reversed(index), seed * 0x9E3779B9u));
+	return reverse_bits(laine_karras_permutation(index, seed));
+}
+
+XPU inline uint32_t rng_next(rng* r) {
+	if (r->type == sampler_type::sobol)
+		return sobol_next(r);
+
+	uint64_t old = r->state;
+	r->state = old * 6364136223846793005ull + 1442695040888963407ull;
+	uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+	uint32_t rot = static_cast<uint32_t>(old >> 59u);
+	return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+}
+
+XPU inline float cu_random_float(rng* local_rand) {
+	// Returns a random real number in (0,1], like curand_uniform
+	return ((rng_next(local_rand) >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+XPU inline float cu_random_float(float min, float max, rng* local_rand) {
+	// Returns a random real number in [min,max)
+	return min + cu_random_float(local_rand) * (max - min);
+}
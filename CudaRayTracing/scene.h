@@ -0,0 +1,583 @@
+#pragma once
+
+#include "aarect.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "instance.h"
+#include "light_bvh.h"
+#include "light_list.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "sphere.h"
+#include "sphere_soa.h"
+#include "texture.h"
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+enum class primitive_type : uint8_t {
+	sphere,
+	moving_sphere,
+	xy_rect,
+	xz_rect,
+	yz_rect,
+	sphere_group,	///> a sphere_soa with its own BVH
+	medium,			///> constant_medium around another primitive
+	instance		///> transformed bottom-level BVH
+};
+
+// A primitive of the scene: its type and its position in the scene's array of that type
+struct primitive {
+	primitive_type type;
+	int index;
+};
+
+// Where one BVH lives in the scene's node and index arrays; its node offsets are relative to first_node
+struct bvh_ref {
+	int first_node;
+	int first_index;
+	int num_nodes;		///> nodes reserved at first_node; a refitted or rebuilt tree may use fewer
+};
+
+// Arrays of a sphere_soa within the scene's: x, y, z and radius are stride floats apart from coords
+struct sphere_group {
+	int coords;
+	int stride;
+	int material_ids;
+	int count;
+	int first_node;
+};
+
+enum class light_sampling : uint8_t {
+	single,		///> lights[0] is the only light
+	list,		///> light_list over the alias table
+	bvh			///> light_bvh over light_nodes
+};
+
+/**
+ * \brief Everything the integrator traces and shades, as flat arrays indexed by integers.
+ * Primitives and materials are tagged unions dispatched in switches rather than through vtables, so a
+ * scene is built on the host by scene_builder and read the same way by either backend. The scene does
+ * not own its arrays and is passed to the render kernel by value.
+ */
+struct scene {
+	const primitive* primitives;
+	const sphere* spheres;
+	const moving_sphere* moving_spheres;
+	const xy_rect* xy_rects;
+	const xz_rect* xz_rects;
+	const yz_rect* yz_rects;
+	const sphere_group* sphere_groups;
+	const float* group_coords;
+	const int* group_material_ids;
+	const constant_medium* media;
+	const instance* instances;
+
+	const bvh_ref* bvhs;
+	const linear_bvh_node* nodes;		///> nodes of every BVH, including those of sphere groups
+	const int* bvh_indices;				///> primitive indices of every BVH's leaves
+	int top_level;						///> the BVH hit() starts from
+
+	const material* materials;
+	texture_set textures;
+
+	light_sampling light_type;
+	int num_lights;
+	const int* lights;					///> primitive indices of the emitters
+	const float* light_select_pdf;
+	const float* light_alias_prob;
+	const int* light_alias;
+	const light_bvh_node* light_nodes;
+
+	XPU linear_bvh bvh(int b) const {
+		return linear_bvh(nodes + bvhs[b].first_node, bvh_indices + bvhs[b].first_index);
+	}
+
+	XPU sphere_soa group(int g) const {
+		const sphere_group& s = sphere_groups[g];
+		const float* c = group_coords + s.coords;
+		return sphere_soa(c, c + s.stride, c + 2 * s.stride, c + 3 * s.stride, group_material_ids + s.material_ids, s.count, nodes + s.first_node);
+	}
+
+	// Media along r draw their free flights from local_rand, in the order the traversal reaches them
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec, rng* local_rand) const {
+		return bvh(top_level).hit(r, t_min, t_max, rec, [this, local_rand](int prim, const ray& r, float t0, float t1, hit_record& rec) {
+			return hit_object(prim, r, t0, t1, rec, local_rand);
+		});
+	}
+
+	// Host only: hit() for every lane set in active at once, lane i drawing from rands[i]; see hit_lanes
+	// for the contract
+	int hit_packet(const ray* rays, const packet_ray& packet, int active, float t_min, packet_float& t_max, hit_record* recs,
+			rng* const* rands) const;
+
+	// A primitive of a top-level BVH: an instance, or anything hit_shape() takes
+	XPU bool hit_object(int prim, const ray& r, float t_min, float t_max, hit_record& rec, rng* local_rand) const;
+
+	// A primitive of a bottom-level BVH: a medium, or anything hit_surface() takes
+	XPU bool hit_shape(int prim, const ray& r, float t_min, float t_max, hit_record& rec, rng* local_rand) const;
+
+	// Any primitive that is not a medium or an instance
+	XPU bool hit_surface(int prim, const ray& r, float t_min, float t_max, hit_record& rec) const;
+
+	// Returns false for primitives without bounds, which do not exist yet
+	XPU bool bounding_box(int prim, float time0, float time1, aabb& output_box) const;
+
+	// Solid angle density of sampling v from o toward one primitive; spheres and rects are emitters
+	GPU float pdf_value(int prim, const point3& o, const vec3& v) const;
+	GPU vec3 random(int prim, const point3& o, rng* local_rand) const;
+
+	// The same over all the lights, as picked by light_type; a scene without lights gives pdf 0 and the
+	// zero direction
+	GPU float light_pdf_value(const point3& o, const vec3& v) const;
+	GPU vec3 light_random(const point3& o, rng* local_rand) const;
+
+	XPU const material& material_at(const hit_record& rec) const {
+		return materials[rec.material_id];
+	}
+};
+
+inline int scene::hit_packet(const ray* rays, const packet_ray& packet, int active, float t_min, packet_float& t_max, hit_record* recs,
+		rng* const* rands) const {
+	return bvh(top_level).hit_packet(rays, packet, active, t_min, t_max, [&](int prim, int mask, packet_float& t) {
+		// spheres share the quadratic across lanes, anything else is traced lane by lane
+		const primitive& p = primitives[prim];
+		if (p.type == primitive_type::sphere)
+			return spheres[p.index].hit_packet(rays, packet, mask, t_min, t, recs);
+		return hit_lanes(rays, mask, t_min, t, recs, [&](int lane, const ray& r, float t0, float t1, hit_record& rec) {
+			return hit_object(prim, r, t0, t1, rec, rands[lane]);
+		});
+	});
+}
+
+XPU inline bool scene::hit_object(int prim, const ray& r, float t_min, float t_max, hit_record& rec, rng* local_rand) const {
+	const primitive& p = primitives[prim];
+	if (p.type != primitive_type::instance)
+		return hit_shape(prim, r, t_min, t_max, rec, local_rand);
+
+	const instance& inst = instances[p.index];
+	const linear_bvh object = bvh(inst.bvh);
+	return inst.hit(r, t_min, t_max, rec, [this, &object, local_rand](const ray& r, float t0, float t1, hit_record& rec) {
+		return object.hit(r, t0, t1, rec, [this, local_rand](int prim, const ray& r, float t0, float t1, hit_record& rec) {
+			return hit_shape(prim, r, t0, t1, rec, local_rand);
+		});
+	});
+}
+
+XPU inline bool scene::hit_shape(int prim, const ray& r, float t_min, float t_max, hit_record& rec, rng* local_rand) const {
+	const primitive& p = primitives[prim];
+	if (p.type != primitive_type::medium)
+		return hit_surface(prim, r, t_min, t_max, rec);
+
+	const constant_medium& medium = media[p.index];
+	return medium.hit(r, t_min, t_max, rec, local_rand, [this, &medium](const ray& r, float t0, float t1, hit_record& rec) {
+		return hit_surface(medium.boundary, r, t0, t1, rec);
+	});
+}
+
+XPU inline bool scene::hit_surface(int prim, const ray& r, float t_min, float t_max, hit_record& rec) const {
+	const primitive& p = primitives[prim];
+	switch (p.type) {
+	case primitive_type::sphere:
+		return spheres[p.index].hit(r, t_min, t_max, rec);
+	case primitive_type::moving_sphere:
+		return moving_spheres[p.index].hit(r, t_min, t_max, rec);
+	case primitive_type::xy_rect:
+		return xy_rects[p.index].hit(r, t_min, t_max, rec);
+	case primitive_type::xz_rect:
+		return xz_rects[p.index].hit(r, t_min, t_max, rec);
+	case primitive_type::yz_rect:
+		return yz_rects[p.index].hit(r, t_min, t_max, rec);
+	case primitive_type::sphere_group:
+		return group(p.index).hit(r, t_min, t_max, rec);
+	default:
+		return false;
+	}
+}
+
+XPU inline bool scene::bounding_box(int prim, float time0, float time1, aabb& output_box) const {
+	const primitive& p = primitives[prim];
+	switch (p.type) {
+	case primitive_type::sphere:
+		return spheres[p.index].bounding_box(time0, time1, output_box);
+	case primitive_type::moving_sphere:
+		return moving_spheres[p.index].bounding_box(time0, time1, output_box);
+	case primitive_type::xy_rect:
+		return xy_rects[p.index].bounding_box(time0, time1, output_box);
+	case primitive_type::xz_rect:
+		return xz_rects[p.index].bounding_box(time0, time1, output_box);
+	case primitive_type::yz_rect:
+		return yz_rects[p.index].bounding_box(time0, time1, output_box);
+	case primitive_type::sphere_group:
+		return group(p.index).bounding_box(time0, time1, output_box);
+	case primitive_type::medium:
+		return bounding_box(media[p.index].boundary, time0, time1, output_box);
+	case primitive_type::instance: {
+		const instance& inst = instances[p.index];
+		output_box = inst.world_bounds(bvh(inst.bvh).nodes[0].bounds);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+GPU inline float scene::pdf_value(int prim, const point3& o, const vec3& v) const {
+	const primitive& p = primitives[prim];
+	switch (p.type) {
+	case primitive_type::sphere:
+		return spheres[p.index].pdf_value(o, v);
+	case primitive_type::xy_rect:
+		return xy_rects[p.index].pdf_value(o, v);
+	case primitive_type::xz_rect:
+		return xz_rects[p.index].pdf_value(o, v);
+	case primitive_type::yz_rect:
+		return yz_rects[p.index].pdf_value(o, v);
+	default:
+		return 0.0f;
+	}
+}
+
+GPU inline vec3 scene::random(int prim, const point3& o, rng* local_rand) const {
+	const primitive& p = primitives[prim];
+	switch (p.type) {
+	case primitive_type::sphere:
+		return spheres[p.index].random(o, local_rand);
+	case primitive_type::xy_rect:
+		return xy_rects[p.index].random(o, local_rand);
+	case primitive_type::xz_rect:
+		return xz_rects[p.index].random(o, local_rand);
+	case primitive_type::yz_rect:
+		return yz_rects[p.index].random(o, local_rand);
+	default:
+		return vec3(1, 0, 0);
+	}
+}
+
+GPU inline float scene::light_pdf_value(const point3& o, const vec3& v) const {
+	if (num_lights == 0)
+		return 0;
+
+	auto light_pdf = [this](int prim, const point3& o, const vec3& v) { return pdf_value(prim, o, v); };
+	switch (light_type) {
+	case light_sampling::list:
+		return light_list(lights, num_lights, light_select_pdf, light_alias_prob, light_alias).pdf_value(o, v, light_pdf);
+	case light_sampling::bvh:
+		return light_bvh(lights, num_lights, light_nodes).pdf_value(o, v, light_pdf);
+	default:
+		return pdf_value(lights[0], o, v);
+	}
+}
+
+GPU inline vec3 scene::light_random(const point3& o, rng* local_rand) const {
+	if (num_lights == 0)
+		return vec3(0, 0, 0);
+
+	auto light_random = [this](int prim, const point3& o, rng* local_rand) { return random(prim, o, local_rand); };
+	switch (light_type) {
+	case light_sampling::list:
+		return light_list(lights, num_lights, light_select_pdf, light_alias_prob, light_alias).random(o, local_rand, light_random);
+	case light_sampling::bvh:
+		return light_bvh(lights, num_lights, light_nodes).random(o, local_rand, light_random);
+	default:
+		return random(lights[0], o, local_rand);
+	}
+}
+
+/*
+ * ----------------------------------------------
+ * Host-side construction
+ */
+
+/**
+ * \brief Collects a scene's primitives, materials, textures, BVHs and lights in host arrays.
+ * Every add returns the index later additions refer to it by. view() is the scene over these arrays,
+ * traced in place on the CPU backend. For CUDA, pack() copies them back to back into one buffer, which
+ * is uploaded in a single transfer and traced through packed_view().
+ */
+class scene_builder {
+public:
+	static constexpr size_t pack_alignment = 64;	///> of every array in a packed scene
+
+	int add_texture(const cu_texture& t) { return push(textures, t); }
+
+	// Adds a noise lattice filled from the host generator, for noise_texture
+	int add_noise() {
+		noise.emplace_back();
+		noise.back().generate();
+		return static_cast<int>(noise.size()) - 1;
+	}
+
+	// Loads an 8-bit RGB image into the texel array; the texture shows solid cyan if the file is missing
+	int add_image_texture(const char* filename);
+
+	int add_material(const material& m) { return push(materials, m); }
+
+	int add(const sphere& s) { return add_primitive(primitive_type::sphere, push(spheres, s)); }
+	int add(const moving_sphere& s) { return add_primitive(primitive_type::moving_sphere, push(moving_spheres, s)); }
+	int add(const xy_rect& r) { return add_primitive(primitive_type::xy_rect, push(xy_rects, r)); }
+	int add(const xz_rect& r) { return add_primitive(primitive_type::xz_rect, push(xz_rects, r)); }
+	int add(const yz_rect& r) { return add_primitive(primitive_type::yz_rect, push(yz_rects, r)); }
+
+	// Volume inside primitive boundary, scattering with material phase
+	int add_medium(int boundary, float density, int phase) {
+		return add_primitive(primitive_type::medium, push(media, constant_medium(boundary, density, phase)));
+	}
+
+	int add_instance(int object_bvh, const affine_transform& transform) {
+		return add_primitive(primitive_type::instance, push(instances, instance(object_bvh, transform)));
+	}
+
+	// Adds a built sphere_soa_builder as one primitive; its material ids are offset by first_material
+	int add_sphere_group(const sphere_soa_builder& group, int first_material);
+
+	// Axis-aligned box from p0 to p1 as six rects, which are added in a row; returns the first
+	int add_box(const point3& p0, const point3& p1, int material_id);
+
+	// Adds a BVH over prims, whose indices in bvh.indices are positions in prims; returns its index
+	int add_bvh(const bvh_build_result& bvh, const std::vector<int>& prims);
+
+	// Replaces the nodes and leaf order of BVH b over the same prims, e.g. after a refit or rebuild.
+	// The tree is written over the old node range when it fits; otherwise the range moves to the end,
+	// sized for the largest tree over prims, so it moves at most once however often the tree is rebuilt.
+	void set_bvh(int b, const bvh_build_result& bvh, const std::vector<int>& prims);
+
+	// Bounds of a primitive as bounding_box() reports them, aabb::empty() if it has none
+	aabb bounds(int prim) const;
+
+	void set_top_level(int b) { top_level = b; }
+
+	// The emitter that shadow rays are aimed at
+	void set_light(int prim);
+	// Emitters picked by power from table, or by importance through light_bvh_builder nodes
+	void set_light_list(const std::vector<int>& prims, const alias_table& table);
+	void set_light_bvh(const std::vector<int>& prims, const std::vector<light_bvh_node>& light_bvh_nodes);
+
+	int num_primitives() const { return static_cast<int>(primitives.size()); }
+
+	// The scene over this builder's arrays; valid until the next add
+	scene view() const;
+
+	// Byte offset of every array in a packed scene, in a fixed order; the last entry is the total size
+	std::vector<size_t> packed_layout() const;
+
+	// Copies every array to bytes + its offset in layout, a packed_layout() of the current arrays
+	void pack(unsigned char* bytes, const std::vector<size_t>& layout) const;
+
+	// The scene over a copy of the packed bytes at base, e.g. in device memory
+	scene packed_view(const unsigned char* base, const std::vector<size_t>& layout) const;
+
+public:
+	std::vector<primitive> primitives;
+	std::vector<sphere> spheres;
+	std::vector<moving_sphere> moving_spheres;
+	std::vector<xy_rect> xy_rects;
+	std::vector<xz_rect> xz_rects;
+	std::vector<yz_rect> yz_rects;
+	std::vector<sphere_group> sphere_groups;
+	std::vector<float> group_coords;
+	std::vector<int> group_material_ids;
+	std::vector<constant_medium> media;
+	std::vector<instance> instances;
+
+	std::vector<bvh_ref> bvhs;
+	std::vector<linear_bvh_node> nodes;
+	std::vector<int> bvh_indices;
+	int top_level = 0;
+
+	std::vector<material> materials;
+	std::vector<cu_texture> textures;
+	std::vector<perlin> noise;
+	std::vector<unsigned char> texels;
+
+	light_sampling light_type = light_sampling::single;
+	std::vector<int> lights;
+	std::vector<float> light_select_pdf;
+	std::vector<float> light_alias_prob;
+	std::vector<int> light_alias;
+	std::vector<light_bvh_node> light_nodes;
+
+private:
+	// Calls f(field, values) for every array field of s with the builder array it holds
+	template<class F>
+	void for_each_array(scene& s, F f) const;
+
+	template<class T>
+	static int push(std::vector<T>& values, const T& value) {
+		values.push_back(value);
+		return static_cast<int>(values.size()) - 1;
+	}
+
+	int add_primitive(primitive_type type, int index) {
+		return push(primitives, primitive{ type, index });
+	}
+};
+
+inline int scene_builder::add_image_texture(const char* filename) {
+	const int bytes_per_pixel = 3;
+	int components_per_pixel = bytes_per_pixel;
+	int width = 0, height = 0;
+	unsigned char* data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
+
+	if (!data) {
+		std::cerr << "ERROR::Image_texture: Could not load image texture file " << filename << ".\n";
+		return add_texture(image_texture(0, 0, 0));
+	}
+
+	int offset = static_cast<int>(texels.size());
+	texels.insert(texels.end(), data, data + width * height * bytes_per_pixel);
+	stbi_image_free(data);
+	return add_texture(image_texture(offset, width, height));
+}
+
+inline int scene_builder::add_sphere_group(const sphere_soa_builder& group, int first_material) {
+	sphere_group g;
+	g.stride = group.padded_size();
+	g.count = group.size();
+	g.coords = static_cast<int>(group_coords.size());
+	for (const std::vector<float>* values : { &group.center_x, &group.center_y, &group.center_z, &group.radius })
+		group_coords.insert(group_coords.end(), values->begin(), values->end());
+
+	g.material_ids = static_cast<int>(group_material_ids.size());
+	for (int id : group.material_ids)
+		group_material_ids.push_back(first_material + id);
+
+	g.first_node = static_cast<int>(nodes.size());
+	nodes.insert(nodes.end(), group.bvh.nodes.begin(), group.bvh.nodes.end());
+	return add_primitive(primitive_type::sphere_group, push(sphere_groups, g));
+}
+
+inline int scene_builder::add_box(const point3& p0, const point3& p1, int material_id) {
+	int first = add(xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), material_id));
+	add(xy_rect(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), material_id));
+
+	add(xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), material_id));
+	add(xz_rect(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), material_id));
+
+	add(yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), material_id));
+	add(yz_rect(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), material_id));
+	return first;
+}
+
+inline int scene_builder::add_bvh(const bvh_build_result& bvh, const std::vector<int>& prims) {
+	bvhs.push_back({ static_cast<int>(nodes.size()), static_cast<int>(bvh_indices.size()), static_cast<int>(bvh.nodes.size()) });
+	nodes.insert(nodes.end(), bvh.nodes.begin(), bvh.nodes.end());
+	for (int i : bvh.indices)
+		bvh_indices.push_back(prims[i]);
+	return static_cast<int>(bvhs.size()) - 1;
+}
+
+inline void scene_builder::set_bvh(int b, const bvh_build_result& bvh, const std::vector<int>& prims) {
+	// the primitive count is fixed, so only the node count can change; a binary tree with at least one
+	// primitive per leaf has at most 2 * prims - 1 nodes
+	bvh_ref& ref = bvhs[b];
+	if (ref.num_nodes < static_cast<int>(bvh.nodes.size())) {
+		int max_nodes = std::max(static_cast<int>(bvh.nodes.size()), 2 * static_cast<int>(prims.size()) - 1);
+		ref = { static_cast<int>(nodes.size()), ref.first_index, max_nodes };
+		nodes.resize(nodes.size() + max_nodes);
+	}
+	std::copy(bvh.nodes.begin(), bvh.nodes.end(), nodes.begin() + ref.first_node);
+	for (size_t i = 0; i < bvh.indices.size(); i++)
+		bvh_indices[ref.first_index + i] = prims[bvh.indices[i]];
+}
+
+inline aabb scene_builder::bounds(int prim) const {
+	aabb box;
+	if (!view().bounding_box(prim, 0, 1, box))
+		return aabb::empty();
+	return box;
+}
+
+inline void scene_builder::set_light(int prim) {
+	light_type = light_sampling::single;
+	lights = { prim };
+}
+
+inline void scene_builder::set_light_list(const std::vector<int>& prims, const alias_table& table) {
+	light_type = light_sampling::list;
+	lights = prims;
+	light_select_pdf = table.pdf;
+	light_alias_prob = table.prob;
+	light_alias = table.alias;
+}
+
+inline void scene_builder::set_light_bvh(const std::vector<int>& prims, const std::vector<light_bvh_node>& light_bvh_nodes) {
+	light_type = light_sampling::bvh;
+	lights = prims;
+	light_nodes = light_bvh_nodes;
+}
+
+template<class F>
+inline void scene_builder::for_each_array(scene& s, F f) const {
+	f(s.primitives, primitives);
+	f(s.spheres, spheres);
+	f(s.moving_spheres, moving_spheres);
+	f(s.xy_rects, xy_rects);
+	f(s.xz_rects, xz_rects);
+	f(s.yz_rects, yz_rects);
+	f(s.sphere_groups, sphere_groups);
+	f(s.group_coords, group_coords);
+	f(s.group_material_ids, group_material_ids);
+	f(s.media, media);
+	f(s.instances, instances);
+
+	f(s.bvhs, bvhs);
+	f(s.nodes, nodes);
+	f(s.bvh_indices, bvh_indices);
+
+	f(s.materials, materials);
+	f(s.textures.textures, textures);
+	f(s.textures.noise, noise);
+	f(s.textures.texels, texels);
+
+	f(s.lights, lights);
+	f(s.light_select_pdf, light_select_pdf);
+	f(s.light_alias_prob, light_alias_prob);
+	f(s.light_alias, light_alias);
+	f(s.light_nodes, light_nodes);
+}
+
+inline scene scene_builder::view() const {
+	scene s;
+	s.top_level = top_level;
+	s.light_type = light_type;
+	s.num_lights = static_cast<int>(lights.size());
+	for_each_array(s, [](auto& field, const auto& values) { field = values.data(); });
+	return s;
+}
+
+inline std::vector<size_t> scene_builder::packed_layout() const {
+	std::vector<size_t> layout;
+	size_t size = 0;
+	scene s;
+	for_each_array(s, [&](auto&, const auto& values) {
+		layout.push_back(size);
+		size += (values.size() * sizeof(values[0]) + pack_alignment - 1) / pack_alignment * pack_alignment;
+	});
+	layout.push_back(size);
+	return layout;
+}
+
+inline void scene_builder::pack(unsigned char* bytes, const std::vector<size_t>& layout) const {
+	int k = 0;
+	scene s;
+	for_each_array(s, [&](auto&, const auto& values) {
+		if (!values.empty())
+			memcpy(bytes + layout[k], values.data(), values.size() * sizeof(values[0]));
+		k++;
+	});
+}
+
+inline scene scene_builder::packed_view(const unsigned char* base, const std::vector<size_t>& layout) const {
+	int k = 0;
+	scene s = view();
+	for_each_array(s, [&](auto& field, const auto&) {
+		field = reinterpret_cast<std::remove_reference_t<decltype(field)>>(base + layout[k++]);
+	});
+	return s;
+}
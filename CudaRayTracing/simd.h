@@ -0,0 +1,493 @@
+#pragma once
+
+#include "ray.h"
+#include "vec3.h"
+
+#include <math.h>
+
+/*
+ * Host-side SIMD math: 4- and 8-wide float lanes, a 4-component vec4, and vec3/ray packets holding
+ * one vector per lane. The backend is picked at compile time (AVX for 8 lanes, SSE2 or NEON for 4,
+ * plain arrays otherwise). NEON is only used on AArch64, as 32-bit ARM lacks the vector divide,
+ * square root and horizontal add used below. vec3 itself stays scalar: its 12-byte layout is shared
+ * with the device through managed memory (aabb, BVH nodes), so host SIMD works on these separate
+ * types instead.
+ */
+
+#if !defined(__CUDA_ARCH__) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SIMD_SSE 1
+#define SIMD_NEON 0
+#include <immintrin.h>
+#elif !defined(__CUDA_ARCH__) && ((defined(__aarch64__) && defined(__ARM_NEON)) || defined(_M_ARM64))
+#define SIMD_SSE 0
+#define SIMD_NEON 1
+#include <arm_neon.h>
+#else
+#define SIMD_SSE 0
+#define SIMD_NEON 0
+#endif
+
+#if SIMD_SSE && (defined(__AVX2__) || defined(__AVX__))
+#define SIMD_AVX 1
+#else
+#define SIMD_AVX 0
+#endif
+
+struct simd4b;
+
+/**
+ * \brief 4 float lanes
+ */
+struct simd4f {
+	static constexpr int width = 4;
+
+#if SIMD_SSE
+	__m128 v;
+	simd4f(__m128 x) : v(x) {}
+#elif SIMD_NEON
+	float32x4_t v;
+	simd4f(float32x4_t x) : v(x) {}
+#else
+	float v[4];
+#endif
+
+	simd4f() {}
+
+	simd4f(float s) {
+#if SIMD_SSE
+		v = _mm_set1_ps(s);
+#elif SIMD_NEON
+		v = vdupq_n_f32(s);
+#else
+		v[0] = v[1] = v[2] = v[3] = s;
+#endif
+	}
+
+	simd4f(float a, float b, float c, float d) {
+		alignas(16) float lanes[4] = { a, b, c, d };
+		*this = load(lanes);
+	}
+
+	static simd4f load(const float* p) {
+#if SIMD_SSE
+		return _mm_loadu_ps(p);
+#elif SIMD_NEON
+		return vld1q_f32(p);
+#else
+		simd4f r;
+		for (int i = 0; i < 4; i++)
+			r.v[i] = p[i];
+		return r;
+#endif
+	}
+
+	void store(float* p) const {
+#if SIMD_SSE
+		_mm_storeu_ps(p, v);
+#elif SIMD_NEON
+		vst1q_f32(p, v);
+#else
+		for (int i = 0; i < 4; i++)
+			p[i] = v[i];
+#endif
+	}
+
+	float operator[](int i) const {
+		alignas(16) float lanes[4];
+		store(lanes);
+		return lanes[i];
+	}
+};
+
+/**
+ * \brief Per-lane mask produced by comparing two simd4f
+ */
+struct simd4b {
+#if SIMD_SSE
+	__m128 v;
+	simd4b(__m128 x) : v(x) {}
+#elif SIMD_NEON
+	uint32x4_t v;
+	simd4b(uint32x4_t x) : v(x) {}
+#else
+	bool v[4];
+#endif
+
+	simd4b() {}
+
+	// Bit i is set when lane i is true
+	int bits() const {
+#if SIMD_SSE
+		return _mm_movemask_ps(v);
+#elif SIMD_NEON
+		const int32x4_t shift = { 0, 1, 2, 3 };
+		return vaddvq_u32(vshlq_u32(vshrq_n_u32(v, 31), shift));
+#else
+		return v[0] | v[1] << 1 | v[2] << 2 | v[3] << 3;
+#endif
+	}
+
+	bool any() const { return bits() != 0; }
+	bool all() const { return bits() == 0xf; }
+};
+
+// min/max return b when a lane of a is NaN, so keep the running value in b
+
+#if SIMD_SSE
+
+inline simd4f operator+(simd4f a, simd4f b) { return _mm_add_ps(a.v, b.v); }
+inline simd4f operator-(simd4f a, simd4f b) { return _mm_sub_ps(a.v, b.v); }
+inline simd4f operator*(simd4f a, simd4f b) { return _mm_mul_ps(a.v, b.v); }
+inline simd4f operator/(simd4f a, simd4f b) { return _mm_div_ps(a.v, b.v); }
+inline simd4f operator-(simd4f a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline simd4f min(simd4f a, simd4f b) { return _mm_min_ps(a.v, b.v); }
+inline simd4f max(simd4f a, simd4f b) { return _mm_max_ps(a.v, b.v); }
+inline simd4f sqrt(simd4f a) { return _mm_sqrt_ps(a.v); }
+
+inline simd4b operator<(simd4f a, simd4f b) { return _mm_cmplt_ps(a.v, b.v); }
+inline simd4b operator<=(simd4f a, simd4f b) { return _mm_cmple_ps(a.v, b.v); }
+inline simd4b operator>(simd4f a, simd4f b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline simd4b operator>=(simd4f a, simd4f b) { return _mm_cmpge_ps(a.v, b.v); }
+inline simd4b operator&(simd4b a, simd4b b) { return _mm_and_ps(a.v, b.v); }
+inline simd4b operator|(simd4b a, simd4b b) { return _mm_or_ps(a.v, b.v); }
+
+// Lanes of a where mask is set, lanes of b elsewhere
+inline simd4f select(simd4b mask, simd4f a, simd4f b) {
+	return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+
+#elif SIMD_NEON
+
+inline simd4f operator+(simd4f a, simd4f b) { return vaddq_f32(a.v, b.v); }
+inline simd4f operator-(simd4f a, simd4f b) { return vsubq_f32(a.v, b.v); }
+inline simd4f operator*(simd4f a, simd4f b) { return vmulq_f32(a.v, b.v); }
+inline simd4f operator/(simd4f a, simd4f b) { return vdivq_f32(a.v, b.v); }
+inline simd4f operator-(simd4f a) { return vnegq_f32(a.v); }
+inline simd4f min(simd4f a, simd4f b) { return vminnmq_f32(a.v, b.v); }
+inline simd4f max(simd4f a, simd4f b) { return vmaxnmq_f32(a.v, b.v); }
+inline simd4f sqrt(simd4f a) { return vsqrtq_f32(a.v); }
+
+inline simd4b operator<(simd4f a, simd4f b) { return vcltq_f32(a.v, b.v); }
+inline simd4b operator<=(simd4f a, simd4f b) { return vcleq_f32(a.v, b.v); }
+inline simd4b operator>(simd4f a, simd4f b) { return vcgtq_f32(a.v, b.v); }
+inline simd4b operator>=(simd4f a, simd4f b) { return vcgeq_f32(a.v, b.v); }
+inline simd4b operator&(simd4b a, simd4b b) { return vandq_u32(a.v, b.v); }
+inline simd4b operator|(simd4b a, simd4b b) { return vorrq_u32(a.v, b.v); }
+
+inline simd4f select(simd4b mask, simd4f a, simd4f b) { return vbslq_f32(mask.v, a.v, b.v); }
+
+#else
+
+#define SIMD4_LANEWISE(op_decl, result_type, expr) \
+	inline result_type op_decl { \
+		result_type r; \
+		for (int i = 0; i < 4; i++) \
+			r.v[i] = expr; \
+		return r; \
+	}
+
+SIMD4_LANEWISE(operator+(simd4f a, simd4f b), simd4f, a.v[i] + b.v[i])
+SIMD4_LANEWISE(operator-(simd4f a, simd4f b), simd4f, a.v[i] - b.v[i])
+SIMD4_LANEWISE(operator*(simd4f a, simd4f b), simd4f, a.v[i] * b.v[i])
+SIMD4_LANEWISE(operator/(simd4f a, simd4f b), simd4f, a.v[i] / b.v[i])
+SIMD4_LANEWISE(operator-(simd4f a), simd4f, -a.v[i])
+SIMD4_LANEWISE(min(simd4f a, simd4f b), simd4f, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+SIMD4_LANEWISE(max(simd4f a, simd4f b), simd4f, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+SIMD4_LANEWISE(sqrt(simd4f a), simd4f, std::sqrt(a.v[i]))
+SIMD4_LANEWISE(operator<(simd4f a, simd4f b), simd4b, a.v[i] < b.v[i])
+SIMD4_LANEWISE(operator<=(simd4f a, simd4f b), simd4b, a.v[i] <= b.v[i])
+SIMD4_LANEWISE(operator>(simd4f a, simd4f b), simd4b, a.v[i] > b.v[i])
+SIMD4_LANEWISE(operator>=(simd4f a, simd4f b), simd4b, a.v[i] >= b.v[i])
+SIMD4_LANEWISE(operator&(simd4b a, simd4b b), simd4b, a.v[i] && b.v[i])
+SIMD4_LANEWISE(operator|(simd4b a, simd4b b), simd4b, a.v[i] || b.v[i])
+SIMD4_LANEWISE(select(simd4b mask, simd4f a, simd4f b), simd4f, mask.v[i] ? a.v[i] : b.v[i])
+
+#undef SIMD4_LANEWISE
+
+#endif
+
+struct simd8b;
+
+/**
+ * \brief 8 float lanes: one AVX register, or two simd4f without AVX
+ */
+struct simd8f {
+	static constexpr int width = 8;
+
+#if SIMD_AVX
+	__m256 v;
+	simd8f(__m256 x) : v(x) {}
+#else
+	simd4f lo, hi;
+	simd8f(simd4f l, simd4f h) : lo(l), hi(h) {}
+#endif
+
+	simd8f() {}
+
+#if SIMD_AVX
+	simd8f(float s) : v(_mm256_set1_ps(s)) {}
+	static simd8f load(const float* p) { return _mm256_loadu_ps(p); }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+#else
+	simd8f(float s) : lo(s), hi(s) {}
+	static simd8f load(const float* p) { return simd8f(simd4f::load(p), simd4f::load(p + 4)); }
+	void store(float* p) const { lo.store(p); hi.store(p + 4); }
+#endif
+
+	float operator[](int i) const {
+		alignas(32) float lanes[8];
+		store(lanes);
+		return lanes[i];
+	}
+};
+
+struct simd8b {
+#if SIMD_AVX
+	__m256 v;
+	simd8b(__m256 x) : v(x) {}
+	int bits() const { return _mm256_movemask_ps(v); }
+#else
+	simd4b lo, hi;
+	simd8b(simd4b l, simd4b h) : lo(l), hi(h) {}
+	int bits() const { return lo.bits() | hi.bits() << 4; }
+#endif
+
+	simd8b() {}
+
+	bool any() const { return bits() != 0; }
+	bool all() const { return bits() == 0xff; }
+};
+
+#if SIMD_AVX
+
+inline simd8f operator+(simd8f a, simd8f b) { return _mm256_add_ps(a.v, b.v); }
+inline simd8f operator-(simd8f a, simd8f b) { return _mm256_sub_ps(a.v, b.v); }
+inline simd8f operator*(simd8f a, simd8f b) { return _mm256_mul_ps(a.v, b.v); }
+inline simd8f operator/(simd8f a, simd8f b) { return _mm256_div_ps(a.v, b.v); }
+inline simd8f operator-(simd8f a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline simd8f min(simd8f a, simd8f b) { return _mm256_min_ps(a.v, b.v); }
+inline simd8f max(simd8f a, simd8f b) { return _mm256_max_ps(a.v, b.v); }
+inline simd8f sqrt(simd8f a) { return _mm256_sqrt_ps(a.v); }
+
+inline simd8b operator<(simd8f a, simd8f b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline simd8b operator<=(simd8f a, simd8f b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline simd8b operator>(simd8f a, simd8f b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline simd8b operator>=(simd8f a, simd8f b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline simd8b operator&(simd8b a, simd8b b) { return _mm256_and_ps(a.v, b.v); }
+inline simd8b operator|(simd8b a, simd8b b) { return _mm256_or_ps(a.v, b.v); }
+
+inline simd8f select(simd8b mask, simd8f a, simd8f b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+
+#else
+
+inline simd8f operator+(simd8f a, simd8f b) { return simd8f(a.lo + b.lo, a.hi + b.hi); }
+inline simd8f operator-(simd8f a, simd8f b) { return simd8f(a.lo - b.lo, a.hi - b.hi); }
+inline simd8f operator*(simd8f a, simd8f b) { return simd8f(a.lo * b.lo, a.hi * b.hi); }
+inline simd8f operator/(simd8f a, simd8f b) { return simd8f(a.lo / b.lo, a.hi / b.hi); }
+inline simd8f operator-(simd8f a) { return simd8f(-a.lo, -a.hi); }
+inline simd8f min(simd8f a, simd8f b) { return simd8f(min(a.lo, b.lo), min(a.hi, b.hi)); }
+inline simd8f max(simd8f a, simd8f b) { return simd8f(max(a.lo, b.lo), max(a.hi, b.hi)); }
+inline simd8f sqrt(simd8f a) { return simd8f(sqrt(a.lo), sqrt(a.hi)); }
+
+inline simd8b operator<(simd8f a, simd8f b) { return simd8b(a.lo < b.lo, a.hi < b.hi); }
+inline simd8b operator<=(simd8f a, simd8f b) { return simd8b(a.lo <= b.lo, a.hi <= b.hi); }
+inline simd8b operator>(simd8f a, simd8f b) { return simd8b(a.lo > b.lo, a.hi > b.hi); }
+inline simd8b operator>=(simd8f a, simd8f b) { return simd8b(a.lo >= b.lo, a.hi >= b.hi); }
+inline simd8b operator&(simd8b a, simd8b b) { return simd8b(a.lo & b.lo, a.hi & b.hi); }
+inline simd8b operator|(simd8b a, simd8b b) { return simd8b(a.lo | b.lo, a.hi | b.hi); }
+
+inline simd8f select(simd8b mask, simd8f a, simd8f b) { return simd8f(select(mask.lo, a.lo, b.lo), select(mask.hi, a.hi, b.hi)); }
+
+#endif
+
+/*
+ * ----------------------------------------------
+ * vec4: one 4-component vector in a simd4f
+ */
+
+/**
+ * \brief Host vector with the vec3 API on top of a simd4f. Directions keep w = 0, so dot and length
+ * over all four lanes equal the vec3 results.
+ */
+class vec4 {
+public:
+	vec4() : e(0.0f) {}
+	vec4(float e0, float e1, float e2, float e3 = 0.0f) : e(e0, e1, e2, e3) {}
+	explicit vec4(const vec3& v, float w = 0.0f) : e(v.x(), v.y(), v.z(), w) {}
+	vec4(simd4f v) : e(v) {}
+
+	float x() const { return e[0]; }
+	float y() const { return e[1]; }
+	float z() const { return e[2]; }
+	float w() const { return e[3]; }
+	float operator[](int i) const { return e[i]; }
+
+	vec3 xyz() const {
+		alignas(16) float lanes[4];
+		e.store(lanes);
+		return vec3(lanes[0], lanes[1], lanes[2]);
+	}
+
+	vec4 operator-() const { return -e; }
+	vec4& operator+=(const vec4& v) { e = e + v.e; return *this; }
+	vec4& operator*=(const vec4& v) { e = e * v.e; return *this; }
+	vec4& operator*=(float t) { e = e * simd4f(t); return *this; }
+	vec4& operator/=(float t) { return *this *= 1 / t; }
+
+	float length_squared() const;
+	float length() const { return std::sqrt(length_squared()); }
+
+public:
+	simd4f e;
+};
+
+inline vec4 operator+(const vec4& u, const vec4& v) { return u.e + v.e; }
+inline vec4 operator-(const vec4& u, const vec4& v) { return u.e - v.e; }
+inline vec4 operator*(const vec4& u, const vec4& v) { return u.e * v.e; }
+inline vec4 operator*(float t, const vec4& v) { return simd4f(t) * v.e; }
+inline vec4 operator*(const vec4& v, float t) { return v.e * simd4f(t); }
+inline vec4 operator/(const vec4& v, float t) { return v.e * simd4f(1 / t); }
+
+// Horizontal sum, splatted to all lanes
+inline simd4f sum_lanes(simd4f a) {
+#if SIMD_SSE
+	__m128 s = _mm_add_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+#elif SIMD_NEON
+	return vdupq_n_f32(vaddvq_f32(a.v));
+#else
+	return simd4f(a.v[0] + a.v[1] + a.v[2] + a.v[3]);
+#endif
+}
+
+inline float dot(const vec4& u, const vec4& v) {
+	return sum_lanes(u.e * v.e)[0];
+}
+
+inline float vec4::length_squared() const {
+	return dot(*this, *this);
+}
+
+inline vec4 cross(const vec4& u, const vec4& v) {
+#if SIMD_SSE
+	// (u.yzx * v.zxy - u.zxy * v.yzx), w stays 0 for directions
+	__m128 u_yzx = _mm_shuffle_ps(u.e.v, u.e.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 v_yzx = _mm_shuffle_ps(v.e.v, v.e.v, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(u.e.v, v_yzx), _mm_mul_ps(u_yzx, v.e.v));
+	return simd4f(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
+	return vec4(u.y() * v.z() - u.z() * v.y(), u.z() * v.x() - u.x() * v.z(), u.x() * v.y() - u.y() * v.x());
+#endif
+}
+
+inline vec4 unit_vector(const vec4& v) {
+	simd4f len2 = sum_lanes(v.e * v.e);
+	return v.e / sqrt(len2);
+}
+
+/*
+ * ----------------------------------------------
+ * Packets: one vec3 or ray per lane, stored as separate x/y/z lanes
+ */
+
+/**
+ * \brief F::width vec3s in structure-of-arrays form, with the same operators as vec3
+ */
+template<class F>
+struct vec3_packet {
+	static constexpr int width = F::width;
+
+	F x, y, z;
+
+	vec3_packet() {}
+	vec3_packet(const F& px, const F& py, const F& pz) : x(px), y(py), z(pz) {}
+
+	// The same vector in every lane
+	explicit vec3_packet(const vec3& v) : x(v.x()), y(v.y()), z(v.z()) {}
+
+	// Lane i holds v[i]
+	static vec3_packet gather(const vec3* v) {
+		alignas(32) float lanes[3][width];
+		for (int i = 0; i < width; i++) {
+			lanes[0][i] = v[i].x();
+			lanes[1][i] = v[i].y();
+			lanes[2][i] = v[i].z();
+		}
+		return vec3_packet(F::load(lanes[0]), F::load(lanes[1]), F::load(lanes[2]));
+	}
+
+	vec3 lane(int i) const { return vec3(x[i], y[i], z[i]); }
+
+	vec3_packet operator-() const { return vec3_packet(-x, -y, -z); }
+	vec3_packet& operator+=(const vec3_packet& v) { x = x + v.x; y = y + v.y; z = z + v.z; return *this; }
+	vec3_packet& operator*=(const vec3_packet& v) { x = x * v.x; y = y * v.y; z = z * v.z; return *this; }
+	vec3_packet& operator*=(const F& t) { x = x * t; y = y * t; z = z * t; return *this; }
+
+	F length_squared() const { return x * x + y * y + z * z; }
+	F length() const { return sqrt(length_squared()); }
+};
+
+template<class F> inline vec3_packet<F> operator+(const vec3_packet<F>& u, const vec3_packet<F>& v) { return vec3_packet<F>(u.x + v.x, u.y + v.y, u.z + v.z); }
+template<class F> inline vec3_packet<F> operator-(const vec3_packet<F>& u, const vec3_packet<F>& v) { return vec3_packet<F>(u.x - v.x, u.y - v.y, u.z - v.z); }
+template<class F> inline vec3_packet<F> operator*(const vec3_packet<F>& u, const vec3_packet<F>& v) { return vec3_packet<F>(u.x * v.x, u.y * v.y, u.z * v.z); }
+template<class F> inline vec3_packet<F> operator*(const F& t, const vec3_packet<F>& v) { return vec3_packet<F>(t * v.x, t * v.y, t * v.z); }
+template<class F> inline vec3_packet<F> operator*(const vec3_packet<F>& v, const F& t) { return t * v; }
+template<class F> inline vec3_packet<F> operator/(const vec3_packet<F>& v, const F& t) { return (F(1.0f) / t) * v; }
+
+template<class F>
+inline F dot(const vec3_packet<F>& u, const vec3_packet<F>& v) {
+	return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+template<class F>
+inline vec3_packet<F> cross(const vec3_packet<F>& u, const vec3_packet<F>& v) {
+	return vec3_packet<F>(u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x);
+}
+
+template<class F>
+inline vec3_packet<F> unit_vector(const vec3_packet<F>& v) {
+	return v / v.length();
+}
+
+/**
+ * \brief F::width rays traced together; lane i of origin and direction belongs to ray i
+ */
+template<class F>
+struct ray_packet {
+	static constexpr int width = F::width;
+
+	vec3_packet<F> orig;
+	vec3_packet<F> dir;
+
+	ray_packet() {}
+	ray_packet(const vec3_packet<F>& origin, const vec3_packet<F>& direction) : orig(origin), dir(direction) {}
+
+	static ray_packet gather(const ray* rays) {
+		vec3 origins[width];
+		vec3 directions[width];
+		for (int i = 0; i < width; i++) {
+			origins[i] = rays[i].origin();
+			directions[i] = rays[i].direction();
+		}
+		return ray_packet(vec3_packet<F>::gather(origins), vec3_packet<F>::gather(directions));
+	}
+
+	vec3_packet<F> at(const F& t) const { return orig + t * dir; }
+};
+
+using vec3x4 = vec3_packet<simd4f>;
+using vec3x8 = vec3_packet<simd8f>;
+using ray4 = ray_packet<simd4f>;
+using ray8 = ray_packet<simd8f>;
+
+// Packet width used for packet tracing: 8 lanes with AVX, 4 otherwise
+#if SIMD_AVX
+using packet_float = simd8f;
+using packet_mask = simd8b;
+#else
+using packet_float = simd4f;
+using packet_mask = simd4b;
+#endif
+using packet_vec3 = vec3_packet<packet_float>;
+using packet_ray = ray_packet<packet_float>;
+constexpr int packet_width = packet_float::width;
@@ -4,25 +4,28 @@
 #include "hittable.h"
 #include "onb.h"
 
-class sphere : public hittable {
+class sphere {
 public:
 	XPU sphere() {}
 
 	//XPU sphere(point3 c, float r) :
 	//		center(c), radius(r) {}
 	// 
-	XPU sphere(point3 c, float r, material* m) :
-			center(c), radius(r), material_ptr(m) {}
+	XPU sphere(point3 c, float r, int m) :
+			center(c), radius(r), material_id(m) {}
 
-	XPU virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
-	GPU virtual bool bounding_box(float time0, float time1, aabb& output_box) const override;
-	GPU virtual float pdf_value(const point3& o, const vec3& v) const override;
-	GPU virtual vec3 random(const vec3& o, curandState* local_rand) const override;
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+	XPU bool bounding_box(float time0, float time1, aabb& output_box) const;
+	GPU float pdf_value(const point3& o, const vec3& v) const;
+	GPU vec3 random(const vec3& o, rng* local_rand) const;
+
+	// Host only: hit() for every lane set in active at once; see hit_lanes for the contract
+	int hit_packet(const ray* rays, const packet_ray& packet, int active, float t_min, packet_float& t_max, hit_record* recs) const;
 
 public:
 	point3 center;
 	float radius;
-	material* material_ptr;
+	int material_id;
 
 private:
 	XPU static void get_sphere_uv(const point3& p, float& u, float& v) {
@@ -68,12 +71,54 @@ XPU inline bool sphere::hit(const ray& r, float t_min, float t_max, hit_record&
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	//get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.material_ptr = material_ptr;
+	rec.material_id = material_id;
 
 	return true;
 }
 
-GPU inline bool sphere::bounding_box(float time0, float time1, aabb& output_box) const {
+inline int sphere::hit_packet(const ray* rays, const packet_ray& packet, int active, float t_min, packet_float& t_max, hit_record* recs) const {
+	// sphere::hit for all lanes at once, in the same operation order so every lane gets the scalar result
+	packet_vec3 oc = packet.orig - packet_vec3(center);
+	packet_float a = packet.dir.length_squared();
+	packet_float half_b = dot(packet.dir, oc);
+	packet_float c = oc.length_squared() - packet_float(radius * radius);
+	packet_float disc = half_b * half_b - a * c;
+	packet_float zero(0.0f);
+
+	int mask = active & (disc >= zero).bits();
+	if (mask == 0)
+		return 0;
+
+	packet_float tmin(t_min);
+	packet_float sqrtd = sqrt(max(disc, zero));
+	packet_float root0 = -(half_b + sqrtd) / a;
+	packet_float root1 = (sqrtd - half_b) / a;
+	packet_mask in0 = (root0 >= tmin) & (root0 <= t_max);
+	packet_mask in1 = (root1 >= tmin) & (root1 <= t_max);
+	mask &= (in0 | in1).bits();
+	if (mask == 0)
+		return 0;
+
+	packet_float root = select(in0, root0, root1);
+	alignas(32) float roots[packet_width];
+	alignas(32) float t[packet_width];
+	root.store(roots);
+	t_max.store(t);
+	for (int i = 0; i < packet_width; i++) {
+		if (mask >> i & 1) {
+			hit_record& rec = recs[i];
+			rec.t = t[i] = roots[i];
+			rec.p = rays[i].at(rec.t);
+			vec3 outward_normal = (rec.p - center) / radius;
+			rec.set_face_normal(rays[i], outward_normal);
+			rec.material_id = material_id;
+		}
+	}
+	t_max = packet_float::load(t);
+	return mask;
+}
+
+XPU inline bool sphere::bounding_box(float time0, float time1, aabb& output_box) const {
 	output_box = aabb(
 			center - vec3(radius, radius, radius),
 			center + vec3(radius, radius, radius));
@@ -86,14 +131,16 @@ GPU inline float sphere::pdf_value(const point3 &o, const vec3 &v) const {
 		return 0;
 	}
 
-	auto cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
-	auto solid_angle = 2 * pi * (1 - cos_theta_max);
+	// 1 - cos_theta_max written as sin^2 / (1 + cos), which does not round to 0 for distant spheres
+	auto sin2_theta_max = radius * radius / (center - o).length_squared();
+	auto cos_theta_max = sqrt(fmax(1 - sin2_theta_max, 0.0f));
+	auto solid_angle = 2 * pi * sin2_theta_max / (1 + cos_theta_max);
 
     return  1 / solid_angle;
 }
 
 
-GPU inline vec3 sphere::random(const point3& o, curandState* local_rand) const {
+GPU inline vec3 sphere::random(const point3& o, rng* local_rand) const {
      vec3 direction = center - o;
      auto distance_squared = direction.length_squared();
      onb uvw;
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "hittable.h"
+#include "bvh.h"
+#include "simd.h"
+
+#include <vector>
+
+/**
+ * \brief Many spheres in one primitive, stored as separate center/radius/material id arrays.
+ * The spheres are kept in the leaf order of their own BVH, so every leaf is a contiguous run that is
+ * intersected as one batch instead of one dispatch per sphere. Does not own its arrays; they are
+ * expected to hold batch_width padding entries past count so a batch never reads out of bounds.
+ */
+class sphere_soa {
+public:
+	static constexpr int batch_width = 8;	///> BVH leaf size and spheres tested per batch
+
+	XPU sphere_soa(const float* x, const float* y, const float* z, const float* r, const int* mat_ids, int n, const linear_bvh_node* bvh_nodes) :
+			center_x(x), center_y(y), center_z(z), radius(r), material_ids(mat_ids), count(n), nodes(bvh_nodes) {}
+
+	XPU bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const;
+
+	XPU bool bounding_box(float time0, float time1, aabb& output_box) const {
+		output_box = nodes[0].bounds;
+		return true;
+	}
+
+	// Tests spheres [first, first + min(num, W)); returns the nearest one hit in [t_min, t_max] and
+	// lowers t_max to its distance, or returns -1
+	template<int W>
+	XPU int intersect_batch(const ray& r, int first, int num, float t_min, float& t_max) const;
+
+public:
+	const float* center_x;
+	const float* center_y;
+	const float* center_z;
+	const float* radius;
+	const int* material_ids;	///> indices into the scene's materials
+	int count;
+	const linear_bvh_node* nodes;
+};
+
+template<int W>
+XPU inline int sphere_soa::intersect_batch(const ray& r, int first, int num, float t_min, float& t_max) const {
+	// same quadratic as sphere::hit; the host SIMD path evaluates 4 spheres at a time without branches
+	const vec3 o = r.origin();
+	const vec3 d = r.direction();
+	const float a = d.length_squared();
+	int nearest = -1;
+
+#if SIMD_SSE || SIMD_NEON
+	static_assert(W % 4 == 0, "SIMD batches are a multiple of 4 spheres");
+	const vec3x4 origin(o);
+	const vec3x4 direction(d);
+	const simd4f va(a), tmin(t_min), tmax(t_max), zero(0.0f);
+	const simd4f lane(0.0f, 1.0f, 2.0f, 3.0f);
+
+	for (int base = 0; base < W && base < num; base += 4) {
+		int i = first + base;
+		vec3x4 oc = origin - vec3x4(simd4f::load(center_x + i), simd4f::load(center_y + i), simd4f::load(center_z + i));
+		simd4f rad = simd4f::load(radius + i);
+
+		simd4f half_b = dot(direction, oc);
+		simd4f c = oc.length_squared() - rad * rad;
+		simd4f disc = half_b * half_b - va * c;
+		simd4f sqrtd = sqrt(max(disc, zero));
+
+		simd4f root0 = -(half_b + sqrtd) / va;
+		simd4f root1 = (sqrtd - half_b) / va;
+		simd4b in0 = (root0 >= tmin) & (root0 <= tmax);
+		simd4b in1 = (root1 >= tmin) & (root1 <= tmax);
+		simd4f root = select(in0, root0, root1);
+		simd4b valid = (disc >= zero) & (in0 | in1) & (lane < simd4f(float(num - base)));
+
+		int mask = valid.bits();
+		if (mask == 0)
+			continue;
+
+		alignas(16) float roots[4];
+		root.store(roots);
+		for (int l = 0; l < 4; l++) {
+			if ((mask >> l & 1) && roots[l] < t_max) {
+				t_max = roots[l];
+				nearest = i + l;
+			}
+		}
+	}
+#else
+	for (int l = 0; l < W; l++) {
+		if (l >= num)
+			break;
+
+		int i = first + l;
+		vec3 oc = o - vec3(center_x[i], center_y[i], center_z[i]);
+		float half_b = dot(d, oc);
+		float c = oc.length_squared() - radius[i] * radius[i];
+		float disc = half_b * half_b - a * c;
+		if (disc < 0)
+			continue;
+
+		float sqrtd = std::sqrt(disc);
+		float root = (-half_b - sqrtd) / a;
+		if (root < t_min || root > t_max) {
+			root = (-half_b + sqrtd) / a;
+			if (root < t_min || root > t_max)
+				continue;
+		}
+		t_max = root;
+		nearest = i;
+	}
+#endif
+
+	return nearest;
+}
+
+XPU inline bool sphere_soa::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	vec3 dir = r.direction();
+	vec3 inv_dir(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z());
+	int dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	int stack[bvh_max_depth];
+	int stack_size = 0;
+	int current = 0;
+	int nearest = -1;
+
+	// same traversal as linear_bvh, with each leaf tested as one batch
+	while (true) {
+		const linear_bvh_node& node = nodes[current];
+		if (node.bounds.hit(r, inv_dir, dir_is_neg, t_min, t_max)) {
+			if (node.num_prims > 0) {
+				// leaves are at most batch_width long unless the builder had to force a larger one
+				for (int b = 0; b < node.num_prims; b += batch_width) {
+					int i = intersect_batch<batch_width>(r, node.offset + b, node.num_prims - b, t_min, t_max);
+					if (i >= 0)
+						nearest = i;
+				}
+				if (stack_size == 0)
+					break;
+				current = stack[--stack_size];
+			} else if (dir_is_neg[node.axis]) {
+				stack[stack_size++] = current + 1;
+				current = node.offset;
+			} else {
+				stack[stack_size++] = node.offset;
+				current = current + 1;
+			}
+		} else {
+			if (stack_size == 0)
+				break;
+			current = stack[--stack_size];
+		}
+	}
+
+	if (nearest < 0)
+		return false;
+
+	point3 center(center_x[nearest], center_y[nearest], center_z[nearest]);
+	rec.t = t_max;
+	rec.p = r.at(rec.t);
+	rec.set_face_normal(r, (rec.p - center) / radius[nearest]);
+	rec.material_id = material_ids[nearest];
+	return true;
+}
+
+/*
+ * ----------------------------------------------
+ * Host-side construction
+ */
+
+/**
+ * \brief Collects spheres on the host and sorts them into the BVH leaf order sphere_soa expects
+ */
+class sphere_soa_builder {
+public:
+	void add(const point3& center, float r, int material_id) {
+		center_x.push_back(center.x());
+		center_y.push_back(center.y());
+		center_z.push_back(center.z());
+		radius.push_back(r);
+		material_ids.push_back(material_id);
+	}
+
+	int size() const { return count; }
+
+	// Padded length of every array, i.e. the number of elements to copy to the scene backend
+	int padded_size() const { return count + sphere_soa::batch_width; }
+
+	// Builds the BVH with build_bvh(boxes, leaf_size) and reorders the arrays to match its leaves
+	template<class F>
+	void build(F build_bvh);
+
+public:
+	std::vector<float> center_x;
+	std::vector<float> center_y;
+	std::vector<float> center_z;
+	std::vector<float> radius;
+	std::vector<int> material_ids;
+	bvh_build_result bvh;
+
+private:
+	template<class T>
+	void reorder(std::vector<T>& values) const {
+		std::vector<T> sorted(padded_size(), T(0));
+		for (int i = 0; i < count; i++)
+			sorted[i] = values[bvh.indices[i]];
+		values.swap(sorted);
+	}
+
+	int count = 0;
+};
+
+template<class F>
+inline void sphere_soa_builder::build(F build_bvh) {
+	count = static_cast<int>(radius.size());
+	std::vector<aabb> boxes(count);
+	for (int i = 0; i < count; i++) {
+		vec3 r(radius[i], radius[i], radius[i]);
+		point3 c(center_x[i], center_y[i], center_z[i]);
+		boxes[i] = aabb(c - r, c + r);
+	}
+	bvh = build_bvh(boxes, sphere_soa::batch_width);
+
+	// leaf ranges index the sorted arrays directly afterwards
+	reorder(center_x);
+	reorder(center_y);
+	reorder(center_z);
+	reorder(radius);
+	reorder(material_ids);
+	for (int i = 0; i < count; i++)
+		bvh.indices[i] = i;
+}
@@ -1,119 +1,118 @@
 #pragma once
 #include "color.h"
 #include "perlin.h"
-#include "stb_image.h"
 
-class cu_texture {
-public:
-	XPU virtual color value(float u, float v, const point3& p) const = 0;
-};
-
-class solid_color : public cu_texture {
-public:
-	XPU solid_color() {}
-	XPU solid_color(color c) :
-			color_value(c) {}
-
-	XPU solid_color(float r, float g, float b) :
-			solid_color(color(r, g, b)) {}
+#include <cstdint>
 
-	XPU virtual color value(float u, float v, const point3& p) const override {
-		return color_value;
-	}
-
-private:
-	color color_value;
+enum class texture_type : uint8_t {
+	solid,		///> one color
+	checker,	///> 3D checker pattern alternating between two other textures
+	noise,		///> Perlin turbulence, gray
+	image		///> 8-bit RGB image mapped over (u, v)
 };
 
-class checker_texture : public cu_texture {
-public:
-	XPU checker_texture() {}
-
-	XPU checker_texture(cu_texture* e, cu_texture* o) :
-		odd(o), even(e) {}
-
-	//XPU checker_texture(color c1, color c2) :				///> don't know how to replace makr_shared
-	//		odd(solid_color(c2)), even(solid_color(c1)) {}
-
-	XPU virtual color value(float u, float v, const point3& p) const override {
-		float sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
-		if (sines < 0)
-			return odd->value(u, v, p);
-		else
-			return even->value(u, v, p);
-	}
-
-public:
-	cu_texture* odd;
-	cu_texture* even;
+/**
+ * \brief Texture as a tagged union: type selects which fields are used. Textures refer to each other,
+ * to noise lattices and to image data by index, so a scene's textures are one flat array that is
+ * built on the host and read the same way on either backend.
+ */
+struct cu_texture {
+	texture_type type;
+	color value;			///> solid
+	int even, odd;			///> checker: the textures it alternates between
+	int noise;				///> noise: index of the perlin lattice
+	float scale;			///> noise: frequency
+	int texels;				///> image: offset of its first byte in the texel array
+	int width, height;		///> image: size in pixels; 0 if the file failed to load
 };
 
-class noise_texture : public cu_texture {
-public:
-	XPU noise_texture() {}
-
-	XPU noise_texture(const float sc) :
-			scale(sc) {}
-
-	XPU virtual color value(float u, float v, const point3& p) const override {
-		return color(1, 1, 1) * 0.5 * (1.0f + sin(scale * p.z() + 10 * noise.turbulence(scale * p)));
-	}
-
-private:
-	perlin noise;
-	float scale;
+inline cu_texture solid_color(color c) {
+	cu_texture t{};
+	t.type = texture_type::solid;
+	t.value = c;
+	return t;
+}
+
+inline cu_texture solid_color(float r, float g, float b) {
+	return solid_color(color(r, g, b));
+}
+
+inline cu_texture checker_texture(int even, int odd) {
+	cu_texture t{};
+	t.type = texture_type::checker;
+	t.even = even;
+	t.odd = odd;
+	return t;
+}
+
+inline cu_texture noise_texture(int noise, float scale) {
+	cu_texture t{};
+	t.type = texture_type::noise;
+	t.noise = noise;
+	t.scale = scale;
+	return t;
+}
+
+inline cu_texture image_texture(int texels, int width, int height) {
+	cu_texture t{};
+	t.type = texture_type::image;
+	t.texels = texels;
+	t.width = width;
+	t.height = height;
+	return t;
+}
+
+/**
+ * \brief The arrays textures are evaluated against: the textures themselves, noise lattices and the
+ * bytes of every image
+ */
+struct texture_set {
+	const cu_texture* textures;
+	const perlin* noise;
+	const unsigned char* texels;
+
+	XPU color value(int texture, float u, float v, const point3& p) const;
 };
 
-class image_texture : public cu_texture {
-public:
-	const static int bytes_per_pixel = 3;
-
-	XPU image_texture() :
-			data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
-
-	XPU image_texture(const char* filename) {
-		auto components_per_pixel = bytes_per_pixel;
-
-		data = stbi_load(filename, &width, &height, &components_per_pixel, components_per_pixel);
-
-		if (!data) {
-			std::cerr << "ERROR::Image_texture: Could not load image texture file " << filename << ".\n";
-			width = height = 0;
-		}
-
-		bytes_per_scanline = bytes_per_pixel * width;
+XPU inline color texture_set::value(int texture, float u, float v, const point3& p) const {
+	// a checker picks one of its two textures, so nested checkers need no recursion
+	const cu_texture* t = textures + texture;
+	while (t->type == texture_type::checker) {
+		float sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
+		t = textures + (sines < 0 ? t->odd : t->even);
 	}
 
-	XPU ~image_texture() {
-		delete data;
-	}
+	switch (t->type) {
+	case texture_type::noise:
+		return color(1, 1, 1) * 0.5 * (1.0f + sin(t->scale * p.z() + 10 * noise[t->noise].turbulence(t->scale * p)));
+
+	case texture_type::image: {
+		const int bytes_per_pixel = 3;
 
-	XPU virtual color value(float u, float v, const point3& p) const override {
 		// return solid cyan if no image texture found
-		if (data == nullptr)
+		if (t->width == 0)
 			return color(0, 1, 1);
 
 		// clamp input texture coordinates to [0, 1] x [1, 0]
 		u = cu_clamp(u, 0.0f, 1.0f);
 		v = 1.0f - cu_clamp(v, 0.0f, 1.0f);	// flip vertical coords
 
-		auto i = static_cast<int>(u * width);
-		auto j = static_cast<int>(v * height);
+		auto i = static_cast<int>(u * t->width);
+		auto j = static_cast<int>(v * t->height);
 
 		// clamp integer mapping since actual coordinates should be < 1.0
-		if (i >= width)
-			i = width - 1;
-		if (j >= height)
-			j = height - 1;
+		if (i >= t->width)
+			i = t->width - 1;
+		if (j >= t->height)
+			j = t->height - 1;
 
 		const float color_scale = 1.0f / 255.0f;
-		unsigned char* pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
+		const unsigned char* pixel = texels + t->texels + (j * t->width + i) * bytes_per_pixel;
 
 		return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
 	}
 
-private:
-	unsigned char* data;
-	int width, height;
-	int bytes_per_scanline;
-};
\ No newline at end of file
+	default:
+		return t->value;
+	}
+}
@@ -1,62 +1,116 @@
 #pragma once
 
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <thread>
 #include <vector>
 #include <iostream>
 
+/**
+ * \brief Work-stealing thread pool: every worker owns a deque, pops its own jobs LIFO and steals
+ * from the front of other workers' deques when it runs dry. Jobs queued from inside a worker go
+ * to that worker's deque, jobs queued from outside are spread round-robin.
+ */
 class thread_pool {
 public:
 	thread_pool() :
-			num_workers(std::thread::hardware_concurrency()), jobs_completed(0) {
+			thread_pool(std::max(1u, std::thread::hardware_concurrency())) {
 	}
 
 	thread_pool(unsigned int nw) :
-			num_workers(nw), jobs_completed(0) {
+			num_workers(std::max(1u, nw)), jobs_completed(0), jobs_queued(0), jobs_pending(0), num_sleeping(0), next_queue(0) {
+		for (unsigned int i = 0; i < num_workers; i++)
+			queues.emplace_back(new worker_queue);
 	}
 
+	~thread_pool() { stop(); }
+
 	void start();
 	void stop();
 
 	template<class F, class... Args>
 	auto queue_job(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
 
-	bool busy();
-	unsigned int num_jobs_queued() const { return jobs.size(); };
-	unsigned int num_jobs_completed() const { return jobs_completed; }
+	// Queues f(0) ... f(count - 1) as count jobs, split into contiguous runs across the worker deques
+	template<class F>
+	void queue_batch(unsigned int count, F f);
+
+	// Runs f(0) ... f(count - 1) on the pool and returns once they are done, helping with queued jobs
+	// meanwhile; safe to call from inside a job
+	template<class F>
+	void parallel_for(unsigned int count, F f);
+
+	bool busy() const { return jobs_pending.load() != 0; }
+	void wait_idle();
+	bool run_pending_job();
+
+	unsigned int num_jobs_queued() const { return jobs_queued.load(); };
+	unsigned int num_jobs_completed() const { return jobs_completed.load(); }
 	void reset_num_jobs_completed() { jobs_completed = 0; }
+	unsigned int num_threads() const { return num_workers; }
 
 private:
-	void thread_loop();
+	struct worker_queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> jobs;
+	};
+
+	void thread_loop(unsigned int index);
+	void push(unsigned int queue, std::function<void()>&& job);
+	void notify_workers(unsigned int count);
+	bool pop_job(unsigned int index, std::function<void()>& job);
+	void run(std::function<void()>& job);
+	int current_worker() const { return worker_owner() == this ? worker_index() : -1; }
+
+	static const thread_pool*& worker_owner() {
+		static thread_local const thread_pool* owner = nullptr;
+		return owner;
+	}
+
+	static int& worker_index() {
+		static thread_local int index = -1;
+		return index;
+	}
 
-	bool should_terminate = false;
+	std::atomic<bool> should_terminate{ false };
 	unsigned int num_workers;
-	unsigned int jobs_completed;
+	std::atomic<unsigned int> jobs_completed;
+	std::atomic<unsigned int> jobs_queued;		///> jobs sitting in a deque
+	std::atomic<unsigned int> jobs_pending;		///> jobs queued or running
+	std::atomic<unsigned int> num_sleeping;
+	std::atomic<unsigned int> next_queue;
 
-	std::mutex queue_mutex;
-	std::mutex count_mutex;
-	std::condition_variable mutex_condition;
+	std::mutex sleep_mutex;
+	std::condition_variable wake_condition;
+	std::condition_variable idle_condition;
 	std::vector<std::thread> threads;
-	std::queue<std::function<void()>> jobs;
+	std::vector<std::unique_ptr<worker_queue>> queues;
 };
 
 inline void thread_pool::start() {
-	threads.resize(num_workers);
+	should_terminate = false;
+	threads.reserve(num_workers);
 	std::cout << "Starting " << num_workers << " workers..." << std::endl;
 	for (unsigned int i = 0; i < num_workers; i++) {
-		threads.emplace_back([this] { this->thread_loop(); });
+		threads.emplace_back([this, i] { this->thread_loop(i); });
 	}
 }
 
 inline void thread_pool::stop() {
 	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
+		std::unique_lock<std::mutex> lock(sleep_mutex);
 		should_terminate = true;
 	}
 
-	mutex_condition.notify_all();
+	wake_condition.notify_all();
 	for (std::thread& active_thread : threads) {
 		try {
 			if (active_thread.joinable())
@@ -66,6 +120,7 @@ inline void thread_pool::stop() {
 			std::cerr << "Thread may have already terminated.\n";
 		}
 	}
+	threads.clear();
 }
 
 template <class F, class... Args>
@@ -74,41 +129,131 @@ inline auto thread_pool::queue_job(F&& f, Args&&... args) -> std::future<typenam
 
 	auto job = std::make_shared<std::packaged_task<return_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 	std::future<return_type> result = job->get_future();
-	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
-		jobs.emplace([job]() { (*job)(); });
-	}
-	mutex_condition.notify_one();
+
+	int worker = current_worker();
+	unsigned int queue = worker >= 0 ? worker : next_queue++ % num_workers;
+	jobs_pending++;
+	push(queue, [job]() { (*job)(); });
+	notify_workers(1);
 	return result;
 }
 
-inline bool thread_pool::busy() {
-	bool pool_busy = true;
-	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
-		pool_busy = !jobs.empty();
+template <class F>
+inline void thread_pool::queue_batch(unsigned int count, F f) {
+	if (count == 0)
+		return;
+
+	jobs_pending += count;
+	unsigned int first_queue = next_queue++;
+	unsigned int per_queue = (count + num_workers - 1) / num_workers;
+	for (unsigned int q = 0, begin = 0; begin < count; q++, begin += per_queue) {
+		unsigned int end = std::min(begin + per_queue, count);
+		worker_queue& wq = *queues[(first_queue + q) % num_workers];
+		std::unique_lock<std::mutex> lock(wq.mutex);
+		for (unsigned int i = begin; i < end; i++)
+			wq.jobs.emplace_back([f, i]() { f(i); });
+		jobs_queued += end - begin;
+	}
+	notify_workers(count);
+}
+
+template <class F>
+inline void thread_pool::parallel_for(unsigned int count, F f) {
+	std::atomic<unsigned int> remaining(count);
+	queue_batch(count, [&f, &remaining](unsigned int i) {
+		f(i);
+		remaining--;
+	});
+	while (remaining.load() != 0) {
+		if (!run_pending_job())
+			std::this_thread::yield();
+	}
+}
+
+inline void thread_pool::push(unsigned int queue, std::function<void()>&& job) {
+	worker_queue& wq = *queues[queue];
+	std::unique_lock<std::mutex> lock(wq.mutex);
+	wq.jobs.push_back(std::move(job));
+	jobs_queued++;
+}
+
+inline void thread_pool::notify_workers(unsigned int count) {
+	// the sleeper count is read after publishing jobs_queued, so a worker about to sleep always sees the new jobs
+	if (num_sleeping.load() == 0)
+		return;
+
+	{ std::unique_lock<std::mutex> lock(sleep_mutex); }
+	if (count == 1)
+		wake_condition.notify_one();
+	else
+		wake_condition.notify_all();
+}
+
+inline bool thread_pool::pop_job(unsigned int index, std::function<void()>& job) {
+	// own deque first, newest job (best cache locality), then steal the oldest job of another worker
+	for (unsigned int n = 0; n < num_workers; n++) {
+		worker_queue& wq = *queues[(index + n) % num_workers];
+		std::unique_lock<std::mutex> lock(wq.mutex);
+		if (wq.jobs.empty())
+			continue;
+
+		if (n == 0) {
+			job = std::move(wq.jobs.back());
+			wq.jobs.pop_back();
+		} else {
+			job = std::move(wq.jobs.front());
+			wq.jobs.pop_front();
+		}
+		jobs_queued--;
+		return true;
 	}
-	return pool_busy;
+	return false;
 }
 
-inline void thread_pool::thread_loop() {
+inline void thread_pool::run(std::function<void()>& job) {
+	job();
+	jobs_completed++;
+	if (--jobs_pending == 0) {
+		{ std::unique_lock<std::mutex> lock(sleep_mutex); }
+		idle_condition.notify_all();
+	}
+}
+
+inline bool thread_pool::run_pending_job() {
+	// lets a thread that is blocked on other jobs help out instead of idling
+	int worker = current_worker();
+	std::function<void()> job;
+	if (!pop_job(worker >= 0 ? worker : 0, job))
+		return false;
+
+	run(job);
+	return true;
+}
+
+inline void thread_pool::wait_idle() {
+	std::unique_lock<std::mutex> lock(sleep_mutex);
+	idle_condition.wait(lock, [this] { return jobs_pending.load() == 0; });
+}
+
+inline void thread_pool::thread_loop(unsigned int index) {
+	worker_owner() = this;
+	worker_index() = index;
+	thread_rng() = host_rng(host_seed(), index + 1);
+
 	while (true) {
 		std::function<void()> job;
-		{
-			std::unique_lock<std::mutex> lock(queue_mutex);
-			mutex_condition.wait(lock, [this] {
-				return should_terminate || !jobs.empty();
-			});
-			if (should_terminate && jobs.empty())
-				return;
-			job = std::move(jobs.front());
-			jobs.pop();
+		if (pop_job(index, job)) {
+			run(job);
+			continue;
 		}
 
-		job();
-		{
-			std::unique_lock<std::mutex> lock(count_mutex);
-			jobs_completed++;
-		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		num_sleeping++;
+		wake_condition.wait(lock, [this] {
+			return should_terminate || jobs_queued.load() != 0;
+		});
+		num_sleeping--;
+		if (should_terminate && jobs_queued.load() == 0)
+			return;
 	}
 }
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+enum class tile_order {
+	scanline,	///> rows of tiles, top to bottom
+	hilbert,	///> along a Hilbert curve, so consecutive tiles are neighbours and share cache lines and BVH nodes
+	spiral		///> rings around the image center outwards, so the subject shows up first
+};
+
+// Pixels [x0, x1) x [y0, y1) of the image
+struct image_tile {
+	int x0, y0, x1, y1;
+};
+
+// Position of the d-th cell along a Hilbert curve filling an n x n grid, n a power of two
+inline void hilbert_d2xy(int n, int d, int& x, int& y) {
+	x = y = 0;
+	for (int s = 1; s < n; s *= 2, d /= 4) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+	}
+}
+
+/**
+ * \brief Splits the image into tiles and hands them to the thread pool one at a time: every worker
+ * pulls the next tile from a shared cursor when it finishes its last one, so an expensive tile only
+ * holds up its own worker. With balance set, a run hands out the tiles that took longest on the
+ * previous run first (longest processing time first), so a progressive render does not end each
+ * pass waiting on a few glass or volume tiles; the first run follows the chosen order.
+ */
+class tile_scheduler {
+public:
+	tile_scheduler(int width, int height, int tile_w, int tile_h, tile_order order);
+
+	int size() const { return static_cast<int>(tiles.size()); }
+
+	// Calls f(const image_tile&) for every tile on the pool and returns once all are done
+	template<class F>
+	void run(thread_pool& pool, F f);
+
+public:
+	bool balance = true;
+	std::vector<image_tile> tiles;	///> in the chosen order
+	std::vector<float> cost;		///> seconds each tile took on the last run, 0 before the first
+
+private:
+	std::vector<int> dispatch;		///> tile indices in the order the next run hands them out
+};
+
+inline tile_scheduler::tile_scheduler(int width, int height, int tile_w, int tile_h, tile_order order) {
+	const int tiles_x = (width + tile_w - 1) / tile_w;
+	const int tiles_y = (height + tile_h - 1) / tile_h;
+	std::vector<int> grid;
+	grid.reserve(tiles_x * tiles_y);
+
+	if (order == tile_order::hilbert) {
+		// walk the curve over the enclosing power-of-two grid, skipping cells outside the image
+		int n = 1;
+		while (n < tiles_x || n < tiles_y)
+			n *= 2;
+		for (int d = 0; d < n * n; d++) {
+			int x, y;
+			hilbert_d2xy(n, d, x, y);
+			if (x < tiles_x && y < tiles_y)
+				grid.push_back(y * tiles_x + x);
+		}
+	} else {
+		for (int t = 0; t < tiles_x * tiles_y; t++)
+			grid.push_back(t);
+		if (order == tile_order::spiral) {
+			// ring by ring from the center tile, each ring in angle order
+			float cx = 0.5f * (tiles_x - 1);
+			float cy = 0.5f * (tiles_y - 1);
+			auto ring = [&](int t) { return std::max(std::fabs(t % tiles_x - cx), std::fabs(t / tiles_x - cy)); };
+			auto angle = [&](int t) { return std::atan2(t / tiles_x - cy, t % tiles_x - cx); };
+			std::stable_sort(grid.begin(), grid.end(), [&](int a, int b) {
+				float ra = ring(a), rb = ring(b);
+				return ra != rb ? ra < rb : angle(a) < angle(b);
+			});
+		}
+	}
+
+	tiles.reserve(grid.size());
+	for (int t : grid) {
+		int x0 = (t % tiles_x) * tile_w;
+		int y0 = (t / tiles_x) * tile_h;
+		tiles.push_back({ x0, y0, std::min(x0 + tile_w, width), std::min(y0 + tile_h, height) });
+	}
+	cost.assign(tiles.size(), 0.0f);
+	dispatch.resize(tiles.size());
+	std::iota(dispatch.begin(), dispatch.end(), 0);
+}
+
+template<class F>
+inline void tile_scheduler::run(thread_pool& pool, F f) {
+	if (balance) {
+		// stable, so tiles of equal cost (all of them on the first run) keep the chosen order
+		std::iota(dispatch.begin(), dispatch.end(), 0);
+		std::stable_sort(dispatch.begin(), dispatch.end(), [this](int a, int b) { return cost[a] > cost[b]; });
+	}
+
+	std::atomic<int> next(0);
+	pool.parallel_for(pool.num_threads(), [&](unsigned int) {
+		for (int k = next++; k < size(); k = next++) {
+			int t = dispatch[k];
+			auto start = std::chrono::steady_clock::now();
+			f(tiles[t]);
+			cost[t] = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		}
+	});
+}
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <cfloat>
+#include <cstdint>
 #include <memory>
 #include <limits>
-#include <random>
-#include "cuda_runtime.h"
-#include "curand_kernel.h"
 
-#define USE_CUDA	// comment to compile for CPU (hopefully)
+// nvcc builds the CUDA backend; compiling main.cu as plain C++ (or defining FORCE_CPU) builds the CPU backend
+#if defined(__CUDACC__) && !defined(FORCE_CPU)
+#define USE_CUDA
+#endif
+
+#ifdef USE_CUDA
+#include "cuda_runtime.h"
+#endif
 
 #ifndef USE_CUDA
 #define XPU
@@ -27,28 +34,69 @@ XPU inline float degrees_to_radians(float degrees) {
 	return degrees * pi / 180.0f;
 }
 
-inline float random_float() {
-	// TODO: found that using the new generator causes some very weird lighting artifacts
-	//static std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-	//static std::mt19937 generator;
-	//return distribution(generator);
+// splitmix64 finalizer: a bijective 64-bit hash with full avalanche
+XPU inline uint64_t mix64(uint64_t z) {
+	z += 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
 
-	// Returns a random real number in [0,1)
-	return rand() / (RAND_MAX + 1.0f);
+/**
+ * \brief xoshiro128+ generator for host code (scene setup, textures, benchmarks). Every thread owns
+ * one, so drawing takes no lock, and the sequence depends only on the seed and the thread's stream.
+ */
+struct host_rng {
+	host_rng(uint64_t seed = 0, uint32_t stream = 0) {
+		uint64_t a = mix64(seed ^ uint64_t(stream) << 32);
+		uint64_t b = mix64(a);
+		s[0] = static_cast<uint32_t>(a);
+		s[1] = static_cast<uint32_t>(a >> 32);
+		s[2] = static_cast<uint32_t>(b);
+		s[3] = static_cast<uint32_t>(b >> 32);
+	}
+
+	uint32_t next() {
+		const uint32_t result = s[0] + s[3];
+		const uint32_t t = s[1] << 9;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = (s[3] << 11) | (s[3] >> 21);
+		return result;
+	}
+
+	uint32_t s[4];
+};
+
+// Seed that threads start their generator from
+inline std::atomic<uint64_t>& host_seed() {
+	static std::atomic<uint64_t> seed(0);
+	return seed;
 }
 
-inline float random_float(float min, float max) {
-	// Returns a random real number in [min,max)
-	return min + random_float() * (max - min);
+// The calling thread's generator; stream 0 until the thread reseeds it (pool workers take their index + 1)
+inline host_rng& thread_rng() {
+	static thread_local host_rng generator(host_seed());
+	return generator;
+}
+
+// Sets the seed for threads started from now on and reseeds the calling thread
+inline void seed_random(uint64_t seed, uint32_t stream = 0) {
+	host_seed() = seed;
+	thread_rng() = host_rng(seed, stream);
 }
 
-GPU inline float cu_random_float(curandState* local_rand) {
-	return curand_uniform(local_rand);
+inline float random_float() {
+	// Returns a random real number in [0,1)
+	return (thread_rng().next() >> 8) * (1.0f / 16777216.0f);
 }
 
-GPU inline float cu_random_float(float min, float max, curandState* local_rand) {
+inline float random_float(float min, float max) {
 	// Returns a random real number in [min,max)
-	return min + cu_random_float(local_rand) * (max - min);
+	return min + random_float() * (max - min);
 }
 
 inline int random_int(int min, int max) {
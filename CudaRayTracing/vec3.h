@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util.h"
+#include "sampler.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -63,11 +64,11 @@ public:
 		return vec3{ random_float(min, max), random_float(min, max), random_float(min, max) };
 	}
 
-	GPU inline static vec3 cu_random(curandState* local_rand) {
-		return vec3{ curand_uniform(local_rand), curand_uniform(local_rand), curand_uniform(local_rand) };
+	GPU inline static vec3 cu_random(rng* local_rand) {
+		return vec3{ cu_random_float(local_rand), cu_random_float(local_rand), cu_random_float(local_rand) };
 	}
 
-	GPU inline static vec3 cu_random(float min, float max, curandState* local_rand) {
+	GPU inline static vec3 cu_random(float min, float max, rng* local_rand) {
 		return vec3{ cu_random_float(min, max, local_rand), cu_random_float(min, max, local_rand), cu_random_float(min, max, local_rand) };
 	}
 
@@ -145,7 +146,7 @@ GPU inline vec3 cu_unit_vector(const vec3& v) {
 using point3 = vec3;
 using color = vec3;
 
-#ifndef USE_CUDA
+// Host-only helpers, driven by random_float()
 
 inline vec3 random_in_unit_disk() {
 	while (true) {
@@ -193,18 +194,18 @@ inline vec3 random_to_sphere(float radius, float distance_squared) {
     return vec3(x, y, z);
 }
 
-#else
+// Helpers taking an explicit per-thread random state, shared by the CUDA and CPU backends
 
-GPU inline vec3 cu_random_in_unit_disk(curandState* local_rand) {
+GPU inline vec3 cu_random_in_unit_disk(rng* local_rand) {
 	while (true) {
-		vec3 p = vec3(curand_uniform(local_rand), curand_uniform(local_rand), 0.0f);
+		vec3 p = vec3(cu_random_float(local_rand), cu_random_float(local_rand), 0.0f);
 		if (p.length_squared() >= 1)
 			continue;
 		return p;
 	}
 }
 
-GPU inline vec3 cu_random_in_unit_sphere(curandState* local_rand) {
+GPU inline vec3 cu_random_in_unit_sphere(rng* local_rand) {
 	while (true) {
 		vec3 p = vec3::cu_random(-1, 1, local_rand);
 		if (p.length_squared() >= 1)
@@ -213,11 +214,11 @@ GPU inline vec3 cu_random_in_unit_sphere(curandState* local_rand) {
 	}
 }
 
-GPU inline vec3 cu_random_unit_vector(curandState* local_rand) {
+GPU inline vec3 cu_random_unit_vector(rng* local_rand) {
 	return unit_vector(cu_random_in_unit_sphere(local_rand));
 }
 
-GPU inline vec3 cu_random_cosine_direction(curandState* local_rand) {
+GPU inline vec3 cu_random_cosine_direction(rng* local_rand) {
 	float r1 = cu_random_float(local_rand);
 	float r2 = cu_random_float(local_rand);
 	float z = sqrt(1 - r2);
@@ -229,14 +230,21 @@ GPU inline vec3 cu_random_cosine_direction(curandState* local_rand) {
 	return vec3(x, y, z);
 }
 
-GPU inline vec3 cu_random_to_sphere(float radius, float distance_squared, curandState* local_rand) {
+GPU inline vec3 cu_random_to_sphere(float radius, float distance_squared, rng* local_rand) {
     auto r1 = cu_random_float(local_rand);
     auto r2 = cu_random_float(local_rand);
-    auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+
+    // 1 - cos_theta_max as sin^2 / (1 + cos), the form sphere::pdf_value uses, and 1 - z from it, so
+    // neither cancels to 0 for distant or small spheres
+    auto sin2_theta_max = radius * radius / distance_squared;
+    auto cos_theta_max = sqrt(fmax(1 - sin2_theta_max, 0.0f));
+    auto one_minus_z = r2 * sin2_theta_max / (1 + cos_theta_max);
+    auto z = 1 - one_minus_z;
+    auto sin_theta = sqrt(one_minus_z * (2 - one_minus_z));
 
     auto phi = 2*pi*r1;
-    auto x = cos(phi)*sqrt(1-z*z);
-    auto y = sin(phi)*sqrt(1-z*z);
+    auto x = cos(phi)*sin_theta;
+    auto y = sin(phi)*sin_theta;
 
     return vec3(x, y, z);
 }
@@ -250,6 +258,4 @@ GPU inline vec3 refract(const vec3& v, const vec3& n, float etai_over_etar) {
 	vec3 ro_perp = etai_over_etar * (v + cos_theta * n);
 	vec3 ro_para = -sqrt(fabs(1.0f - ro_perp.length_squared())) * n;
 	return ro_perp + ro_para;
-}
-
-#endif // USE_CUDA
\ No newline at end of file
+}
\ No newline at end of file
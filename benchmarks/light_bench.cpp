@@ -0,0 +1,118 @@
+// Variance of one-sample direct lighting against the number of lights, for uniform and power-based
+// selection from a light_list and for importance-based selection through a light_bvh.
+//
+//   g++ -std=c++17 -O2 -I CudaRayTracing benchmarks/light_bench.cpp -o light_bench
+//
+// Small sphere lamps of widely varying power hover over a large floor; each shading point on the floor
+// draws samples_per_point light samples (no occlusion) and the per-point variance is averaged.
+// Power-based selection ignores distance: with few lamps the points right under one dominate the
+// average, and when that lamp is dim, power weighting picks it less often than uniform selection.
+
+#include "util.h"
+#include "vec3.h"
+#include "scene.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+const int light_counts[] = { 16, 64, 256, 1024, 4096 };
+const int num_points = 256;
+const int samples_per_point = 64;
+const float floor_size = 200.0f;
+
+struct lamp_set {
+	std::vector<int> spheres;		///> primitive indices in the scene
+	std::vector<float> power;
+	std::vector<light_bounds> bounds;
+};
+
+// Adds n lamps to world with a BVH over them as its top level
+lamp_set make_lamps(int n, scene_builder& world) {
+	lamp_set lamps;
+	std::vector<aabb> boxes;
+	for (int i = 0; i < n; i++) {
+		point3 center(random_float(-0.5f, 0.5f) * floor_size, random_float(1.0f, 4.0f), random_float(-0.5f, 0.5f) * floor_size);
+		float radius = 0.2f;
+		float emit = std::pow(10.0f, random_float(0.0f, 2.0f));
+		int emitter = world.add_material(diffuse_light(world.add_texture(solid_color(emit, emit, emit))));
+		lamps.spheres.push_back(world.add(sphere(center, radius, emitter)));
+		lamps.power.push_back(emit * 4 * pi * radius * radius);
+		lamps.bounds.push_back(sphere_light_bounds(center, radius, lamps.power.back()));
+		boxes.push_back(world.bounds(lamps.spheres.back()));
+	}
+
+	bvh_builder bvh(boxes);
+	bvh.build();
+	world.set_top_level(world.add_bvh(bvh, lamps.spheres));
+	return lamps;
+}
+
+// Relative variance (mean per-point variance over the squared mean estimate) and ns per sample for the
+// light sampling set up in world; emission is looked up by tracing world, the same for every sampler
+void measure(const char* name, int n, const scene& world, const std::vector<point3>& points) {
+	const vec3 normal(0, 1, 0);
+
+	double sum_mean = 0, sum_variance = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < points.size(); i++) {
+		const point3& p = points[i];
+		double sum = 0, sum2 = 0;
+		for (int s = 0; s < samples_per_point; s++) {
+			// one stream per sample, entered at the light slot as sample_light does
+			rng rand(uint32_t(i), s, sampler_type::independent, 7);
+			rand.start_slot(slot_light_select);
+			vec3 direction = world.light_random(p, &rand);
+			float pdf = 0;
+			if (direction.length_squared() > 0) {
+				direction = unit_vector(direction);
+				pdf = world.light_pdf_value(p, direction);
+			}
+			float value = 0;
+			hit_record rec;
+			rand.start_slot(slot_shadow_medium);
+			if (pdf > 0 && world.hit(ray(p, direction), 0.001f, FLT_MAX, rec, &rand)) {
+				float cosine = fmaxf(dot(normal, direction), 0.0f);
+				value = world.material_at(rec).emitted(ray(p, direction), rec, world.textures, rec.u, rec.v, rec.p).x() * cosine / pi / pdf;
+			}
+			sum += value;
+			sum2 += double(value) * value;
+		}
+		double mean = sum / samples_per_point;
+		sum_mean += mean;
+		sum_variance += sum2 / samples_per_point - mean * mean;
+	}
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	double mean = sum_mean / points.size();
+	double variance = sum_variance / points.size();
+	printf("%6d lights  %-8s  mean %9.4f  relative variance %10.4f  %8.1f ns/sample\n", n, name, mean, variance / (mean * mean),
+			ns / (double(points.size()) * samples_per_point));
+}
+
+int main() {
+	std::vector<point3> points;
+	for (int i = 0; i < num_points; i++)
+		points.push_back(point3(random_float(-0.5f, 0.5f) * floor_size, 0, random_float(-0.5f, 0.5f) * floor_size));
+
+	for (int n : light_counts) {
+		scene_builder world;
+		lamp_set lamps = make_lamps(n, world);
+
+		world.set_light_list(lamps.spheres, alias_table(std::vector<float>(n, 1.0f)));
+		measure("uniform", n, world.view(), points);
+
+		world.set_light_list(lamps.spheres, alias_table(lamps.power));
+		measure("power", n, world.view(), points);
+
+		light_bvh_builder builder;
+		for (const light_bounds& b : lamps.bounds)
+			builder.add(b);
+		builder.build();
+		world.set_light_bvh(lamps.spheres, builder.nodes);
+		measure("bvh", n, world.view(), points);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,141 @@
+// Per-frame update of a two-level scene whose instanced geometry moves: refitting the BVHs against
+// rebuilding them every frame, and what goes wrong when only the bottom level is refitted.
+//
+//   g++ -std=c++17 -O2 -I CudaRayTracing benchmarks/refit_bench.cpp -pthread -o refit_bench
+//
+// A cluster of drifting spheres is the bottom level; a grid of instances of it plus a ground sphere
+// is the top level. Every frame moves the spheres, updates the scene and traces a fixed set of rays;
+// the hits are compared against a scene rebuilt from scratch for the same frame.
+
+#include "util.h"
+#include "vec3.h"
+#include "accel.h"
+#include "scene.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+const int cluster_spheres = 4096;
+const int instance_grid = 16;
+const int num_frames = 30;
+const int num_rays = 20000;
+const float drift_per_frame = 0.01f;
+
+bvh_build_result build_bvh(const std::vector<aabb>& boxes) {
+	bvh_builder builder(boxes);
+	builder.build();
+	return std::move(builder);
+}
+
+/**
+ * \brief The scene at a given frame, built from scratch. random_float is reseeded, so every instance of it has
+ * the same spheres and instance transforms.
+ */
+struct animated_scene {
+	animated_scene(float rebuild_threshold, int frame);
+
+	void move_spheres(int frame);
+
+	scene_builder world;
+	scene_accel accel;
+	std::vector<vec3> start;		///> sphere centers at frame 0, by sphere index
+	std::vector<vec3> velocity;
+};
+
+animated_scene::animated_scene(float rebuild_threshold, int frame) :
+		accel(rebuild_threshold) {
+	seed_random(7);
+	int mat = world.add_material(lambertian(world.add_texture(solid_color(0.5f, 0.5f, 0.5f))));
+
+	accel_level& cluster = accel.add_bottom();
+	for (int i = 0; i < cluster_spheres; i++) {
+		start.push_back(vec3(random_float(-1.0f, 1.0f), random_float(0.0f, 2.0f), random_float(-1.0f, 1.0f)));
+		velocity.push_back(vec3(random_float(-1.0f, 1.0f), random_float(-1.0f, 1.0f), random_float(-1.0f, 1.0f)) * drift_per_frame);
+		cluster.prims.push_back(world.add(sphere(start.back(), 0.03f, mat)));
+	}
+	move_spheres(frame);
+	update_accel(world, cluster, build_bvh);
+
+	for (int j = 0; j < instance_grid; j++) {
+		for (int i = 0; i < instance_grid; i++) {
+			vec3 offset((i - instance_grid / 2) * 3.0f, 0, (j - instance_grid / 2) * 3.0f);
+			accel.top.prims.push_back(world.add_instance(cluster.bvh, affine_transform::translate(offset) * affine_transform::rotate_y(random_float(0, 360))));
+		}
+	}
+	accel.top.prims.push_back(world.add(sphere(vec3(0, -1000, 0), 1000, mat)));
+	update_accel(world, accel.top, build_bvh);
+	world.set_top_level(accel.top.bvh);
+}
+
+// The cluster spheres are the first ones added
+void animated_scene::move_spheres(int frame) {
+	for (size_t i = 0; i < start.size(); i++)
+		world.spheres[i].center = start[i] + float(frame) * velocity[i];
+}
+
+// Distance to the first hit of every ray, -1 for a miss
+std::vector<float> trace(const scene& world, const std::vector<ray>& rays) {
+	std::vector<float> t(rays.size());
+	for (size_t i = 0; i < rays.size(); i++) {
+		hit_record rec;
+		rng rand(uint32_t(i), 0);
+		t[i] = world.hit(rays[i], 0.001f, FLT_MAX, rec, &rand) ? rec.t : -1.0f;
+	}
+	return t;
+}
+
+int count_mismatches(const std::vector<float>& a, const std::vector<float>& b) {
+	int n = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		n += std::fabs(a[i] - b[i]) > 1e-4f;
+	return n;
+}
+
+enum class update_mode {
+	refit,			///> both levels through scene_accel::update, rebuilding only degraded trees
+	rebuild,		///> both levels rebuilt every frame
+	bottom_only		///> the cluster refitted, the instance level left as it was
+};
+
+void run(const char* name, update_mode mode, const std::vector<ray>& rays) {
+	animated_scene s(mode == update_mode::rebuild ? 0.0f : 1.3f, 0);
+
+	double update_ms = 0, cost_ratio = 0;
+	int rebuilds = 0, mismatches = 0;
+	for (int frame = 1; frame <= num_frames; frame++) {
+		s.move_spheres(frame);
+		auto start = std::chrono::steady_clock::now();
+		if (mode == update_mode::bottom_only) {
+			rebuilds += update_accel(s.world, s.accel.bottom[0], build_bvh);
+		} else {
+			s.accel.update(s.world, build_bvh, [&rebuilds](const accel_level&, bool rebuilt) { rebuilds += rebuilt; });
+		}
+		update_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		cost_ratio += s.accel.bottom[0].tree.cost_ratio();
+
+		animated_scene reference(1.3f, frame);
+		mismatches += count_mismatches(trace(s.world.view(), rays), trace(reference.world.view(), rays));
+	}
+
+	printf("%-12s  %8.3f ms/frame  %3d rebuilds over %d frames  mean BLAS SAH cost %5.2fx  %6d of %d hits differ\n", name,
+			update_ms / num_frames, rebuilds, num_frames, cost_ratio / num_frames, mismatches, num_frames * num_rays);
+}
+
+int main() {
+	// short rays from just above a random instance down into it: with distant origins the sphere test's
+	// cancellation error, not the BVH, would decide grazing hits on these small spheres
+	std::vector<ray> rays;
+	for (int i = 0; i < num_rays; i++) {
+		vec3 offset((random_int(0, instance_grid - 1) - instance_grid / 2) * 3.0f, 0, (random_int(0, instance_grid - 1) - instance_grid / 2) * 3.0f);
+		point3 origin = offset + vec3(random_float(-1.5f, 1.5f), 4.0f, random_float(-1.5f, 1.5f));
+		point3 target = offset + vec3(random_float(-1.5f, 1.5f), random_float(-0.5f, 2.5f), random_float(-1.5f, 1.5f));
+		rays.push_back(ray(origin, unit_vector(target - origin)));
+	}
+
+	run("refit", update_mode::refit, rays);
+	run("rebuild", update_mode::rebuild, rays);
+	run("bottom only", update_mode::bottom_only, rays);
+	return 0;
+}
@@ -0,0 +1,135 @@
+// Throughput of dot/cross/normalize for scalar vec3 against the host SIMD types in simd.h.
+//
+//   g++ -std=c++17 -O2 -march=native -I CudaRayTracing benchmarks/simd_bench.cpp -o simd_bench
+//
+// Compare builds with -march=native (AVX), the default (SSE2) and -U__SSE2__ (scalar lanes).
+
+#include "util.h"
+#include "vec3.h"
+#include "simd.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+const int num_vectors = 1 << 14;	// fits in L2, so the loops measure arithmetic rather than memory
+const int repeats = 400;
+
+// Vectors of a benchmark run in every layout the variants need
+struct inputs {
+	std::vector<vec3> a, b;
+	std::vector<vec4> a4, b4;
+	std::vector<float> ax, ay, az, bx, by, bz;
+};
+
+// Scalar and SoA outputs; every variant writes x/y/z (dot only x)
+struct outputs {
+	std::vector<vec3> v;
+	std::vector<vec4> v4;
+	std::vector<float> x, y, z;
+
+	outputs() : v(num_vectors), v4(num_vectors), x(num_vectors), y(num_vectors), z(num_vectors) {}
+};
+
+template<class F>
+double run(F f) {
+	f();	// warm up
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; r++)
+		f();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return double(num_vectors) * repeats / seconds / 1e6;
+}
+
+template<class F>
+vec3_packet<F> load_packet(const std::vector<float>& x, const std::vector<float>& y, const std::vector<float>& z, int i) {
+	return vec3_packet<F>(F::load(&x[i]), F::load(&y[i]), F::load(&z[i]));
+}
+
+template<class F>
+void store_packet(outputs& out, const vec3_packet<F>& v, int i) {
+	v.x.store(&out.x[i]);
+	v.y.store(&out.y[i]);
+	v.z.store(&out.z[i]);
+}
+
+template<class F>
+void packet_dot(const inputs& in, outputs& out) {
+	for (int i = 0; i < num_vectors; i += F::width)
+		dot(load_packet<F>(in.ax, in.ay, in.az, i), load_packet<F>(in.bx, in.by, in.bz, i)).store(&out.x[i]);
+}
+
+template<class F>
+void packet_cross(const inputs& in, outputs& out) {
+	for (int i = 0; i < num_vectors; i += F::width)
+		store_packet(out, cross(load_packet<F>(in.ax, in.ay, in.az, i), load_packet<F>(in.bx, in.by, in.bz, i)), i);
+}
+
+template<class F>
+void packet_normalize(const inputs& in, outputs& out) {
+	for (int i = 0; i < num_vectors; i += F::width)
+		store_packet(out, unit_vector(load_packet<F>(in.ax, in.ay, in.az, i)), i);
+}
+
+// Largest difference between the SoA/vec4 output and the scalar reference
+float max_error(const outputs& ref, const outputs& out, bool use_vec4, bool dot_only) {
+	float err = 0.0f;
+	for (int i = 0; i < num_vectors; i++) {
+		vec3 got = use_vec4 ? out.v4[i].xyz() : vec3(out.x[i], out.y[i], out.z[i]);
+		vec3 expected = ref.v[i];
+		if (dot_only) {
+			got = vec3(use_vec4 ? out.x[i] : got.x(), 0, 0);
+			expected = vec3(ref.x[i], 0, 0);
+		}
+		err = std::max(err, (got - expected).length());
+	}
+	return err;
+}
+
+int main() {
+	inputs in;
+	for (int i = 0; i < num_vectors; i++) {
+		vec3 a = vec3::random(-1, 1);
+		vec3 b = vec3::random(-1, 1);
+		in.a.push_back(a);
+		in.b.push_back(b);
+		in.a4.push_back(vec4(a));
+		in.b4.push_back(vec4(b));
+		in.ax.push_back(a.x());
+		in.ay.push_back(a.y());
+		in.az.push_back(a.z());
+		in.bx.push_back(b.x());
+		in.by.push_back(b.y());
+		in.bz.push_back(b.z());
+	}
+
+	std::printf("backend: %s, 8 lanes: %s\n", SIMD_SSE ? "SSE" : (SIMD_NEON ? "NEON" : "scalar"), SIMD_AVX ? "AVX" : "2 x 4");
+	std::printf("%-10s %12s %12s %12s %12s   (Mvec/s, max error vs vec3)\n", "op", "vec3", "vec4", "vec3x4", "vec3x8");
+
+	for (int op = 0; op < 3; op++) {
+		outputs ref, out4, out_x4, out_x8;
+		double scalar, single, x4, x8;
+		if (op == 0) {
+			scalar = run([&] { for (int i = 0; i < num_vectors; i++) ref.x[i] = dot(in.a[i], in.b[i]); });
+			single = run([&] { for (int i = 0; i < num_vectors; i++) out4.x[i] = dot(in.a4[i], in.b4[i]); });
+			x4 = run([&] { packet_dot<simd4f>(in, out_x4); });
+			x8 = run([&] { packet_dot<simd8f>(in, out_x8); });
+		} else if (op == 1) {
+			scalar = run([&] { for (int i = 0; i < num_vectors; i++) ref.v[i] = cross(in.a[i], in.b[i]); });
+			single = run([&] { for (int i = 0; i < num_vectors; i++) out4.v4[i] = cross(in.a4[i], in.b4[i]); });
+			x4 = run([&] { packet_cross<simd4f>(in, out_x4); });
+			x8 = run([&] { packet_cross<simd8f>(in, out_x8); });
+		} else {
+			scalar = run([&] { for (int i = 0; i < num_vectors; i++) ref.v[i] = unit_vector(in.a[i]); });
+			single = run([&] { for (int i = 0; i < num_vectors; i++) out4.v4[i] = unit_vector(in.a4[i]); });
+			x4 = run([&] { packet_normalize<simd4f>(in, out_x4); });
+			x8 = run([&] { packet_normalize<simd8f>(in, out_x8); });
+		}
+
+		const char* names[3] = { "dot", "cross", "normalize" };
+		bool dot_only = op == 0;
+		std::printf("%-10s %12.1f %12.1f %12.1f %12.1f   (%g %g %g)\n", names[op], scalar, single, x4, x8,
+				max_error(ref, out4, true, dot_only), max_error(ref, out_x4, false, dot_only), max_error(ref, out_x8, false, dot_only));
+	}
+	return 0;
+}